@@ -5,6 +5,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 #include <curl/curl.h>
 
@@ -24,6 +25,21 @@ static const struct rpc_method_t method_table[] = {
   },
 };
 
+/* keep request URIs well below what aurweb and proxies will accept */
+static const size_t kMaxUrlLength = 4000;
+
+/* an endpoint which keeps failing is left alone for twice as long each time,
+ * up to this long, in microseconds */
+static const uint64_t kEndpointBackoffBase = 1000000;
+static const uint64_t kEndpointBackoffMax = 60000000;
+
+/* after this long without a request, an endpoint's latency is measured anew
+ * rather than trusted, in microseconds */
+static const uint64_t kEndpointStale = 30000000;
+
+/* weight given to each new latency sample */
+static const double kEndpointSmoothing = 0.25;
+
 static const char *search_by_to_string[] = {
   [SEARCHBY_NAME]       = "name",
   [SEARCHBY_NAME_DESC]  = "name-desc",
@@ -85,12 +101,206 @@ char *aur_build_rpc_url(aur_t *aur, rpc_type type, rpc_by by, const char *arg) {
   return url;
 }
 
+/* Build a single info request for as many of args as fit in a URL the AUR
+ * will accept. The number of args used is returned in consumed. */
+char *aur_build_rpc_info_url(aur_t *aur, const char **args, int nargs, int *consumed) {
+  const struct rpc_method_t *method = &method_table[RPC_INFO];
+  char *url, *p;
+  size_t len, cap;
+  int i;
+
+  if (nargs <= 0) {
+    return NULL;
+  }
+
+  cap = kMaxUrlLength + 1;
+  url = malloc(cap);
+  if (url == NULL) {
+    return NULL;
+  }
+
+  len = snprintf(url, cap, "%s/rpc.php?v=%d&%s", aur->urlprefix, aur->rpc_version,
+      method->type);
+
+  for (i = 0; i < nargs; ++i) {
+    char *escaped = curl_easy_escape(NULL, args[i], 0);
+    size_t arglen;
+
+    if (escaped == NULL) {
+      free(url);
+      return NULL;
+    }
+
+    arglen = strlen(method->argkey) + strlen(escaped) + 2;
+
+    /* always take at least one arg, however long it may be */
+    if (len + arglen > kMaxUrlLength && i > 0) {
+      free(escaped);
+      break;
+    }
+
+    if (len + arglen + 1 > cap) {
+      cap = len + arglen + 1;
+      p = realloc(url, cap);
+      if (p == NULL) {
+        free(escaped);
+        free(url);
+        return NULL;
+      }
+      url = p;
+    }
+
+    len += sprintf(url + len, "&%s=%s", method->argkey, escaped);
+    free(escaped);
+  }
+
+  *consumed = i;
+  return url;
+}
+
 char *aur_build_url(aur_t *aur, const char *urlpath) {
   return aur_urlf(aur, urlpath);
 }
 
+static uint64_t now_usec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int aur_add_endpoint(aur_t *aur, const char *proto, const char *domain) {
+  struct aur_endpoint_t *endpoints, *e;
+  int r;
+
+  if (aur == NULL || proto == NULL || domain == NULL) {
+    return -EINVAL;
+  }
+
+  endpoints = realloc(aur->endpoints, (aur->nendpoints + 1) * sizeof(*endpoints));
+  if (endpoints == NULL) {
+    return -ENOMEM;
+  }
+  aur->endpoints = endpoints;
+
+  e = &endpoints[aur->nendpoints];
+  memset(e, 0, sizeof(*e));
+
+  if (strstr(domain, "://") != NULL) {
+    r = asprintf(&e->urlprefix, "%s", domain);
+  } else {
+    r = asprintf(&e->urlprefix, "%s://%s", proto, domain);
+  }
+  if (r < 0) {
+    return -ENOMEM;
+  }
+
+  /* a trailing slash would double up with the paths appended to this */
+  while (r > 0 && e->urlprefix[r - 1] == '/') {
+    e->urlprefix[--r] = '\0';
+  }
+
+  aur->urlprefix = endpoints[0].urlprefix;
+  aur->nendpoints++;
+
+  return 0;
+}
+
+int aur_endpoint_pick(aur_t *aur) {
+  const uint64_t now = now_usec();
+  int i, best = -1, soonest = 0;
+
+  if (aur->nendpoints == 1) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&aur->lock);
+
+  for (i = 0; i < aur->nendpoints; i++) {
+    struct aur_endpoint_t *e = &aur->endpoints[i];
+
+    if (e->down_until < aur->endpoints[soonest].down_until) {
+      soonest = i;
+    }
+
+    if (e->down_until > now) {
+      continue;
+    }
+
+    /* unmeasured, or measured so long ago it may as well not have been */
+    if (!e->measured || now - e->last_used > kEndpointStale) {
+      e->measured = 0;
+      best = i;
+      break;
+    }
+
+    if (best < 0 || e->latency < aur->endpoints[best].latency) {
+      best = i;
+    }
+  }
+
+  /* with everything failing, try whichever comes back soonest */
+  if (best < 0) {
+    best = soonest;
+  }
+
+  aur->endpoints[best].last_used = now;
+
+  pthread_mutex_unlock(&aur->lock);
+
+  return best;
+}
+
+char *aur_endpoint_url(aur_t *aur, int endpoint, const char *url) {
+  const size_t len = strlen(aur->urlprefix);
+  char *out;
+
+  if (strncmp(url, aur->urlprefix, len) != 0) {
+    return strdup(url);
+  }
+
+  if (asprintf(&out, "%s%s", aur->endpoints[endpoint].urlprefix, url + len) < 0) {
+    return NULL;
+  }
+
+  return out;
+}
+
+void aur_endpoint_report(aur_t *aur, int endpoint, int ok, uint64_t latency) {
+  struct aur_endpoint_t *e;
+
+  if (aur->nendpoints == 1) {
+    return;
+  }
+
+  pthread_mutex_lock(&aur->lock);
+
+  e = &aur->endpoints[endpoint];
+  if (ok) {
+    e->failures = 0;
+    e->down_until = 0;
+    if (latency > 0) {
+      if (!e->measured) {
+        e->latency = latency;
+        e->measured = 1;
+      } else {
+        e->latency += kEndpointSmoothing * (latency - e->latency);
+      }
+    }
+  } else {
+    uint64_t backoff = kEndpointBackoffBase << (e->failures < 6 ? e->failures : 6);
+
+    e->failures++;
+    e->down_until = now_usec() + (backoff < kEndpointBackoffMax ? backoff : kEndpointBackoffMax);
+  }
+
+  pthread_mutex_unlock(&aur->lock);
+}
+
 int aur_new(const char *proto, const char *domain, aur_t **aur) {
   aur_t *a;
+  int r;
 
   if (proto == NULL || domain == NULL || aur == NULL) {
     return -EINVAL;
@@ -105,9 +315,12 @@ int aur_new(const char *proto, const char *domain, aur_t **aur) {
     return -ENOMEM;
   }
 
-  if (asprintf(&a->urlprefix, "%s://%s", proto, domain) < 0) {
-    free(a);
-    return -ENOMEM;
+  pthread_mutex_init(&a->lock, NULL);
+
+  r = aur_add_endpoint(a, proto, domain);
+  if (r < 0) {
+    aur_free(a);
+    return r;
   }
 
   a->rpc_version = 5;
@@ -117,12 +330,18 @@ int aur_new(const char *proto, const char *domain, aur_t **aur) {
 }
 
 void aur_free(aur_t *aur) {
+  int i;
+
   if (aur == NULL) {
     return;
   }
 
   curl_global_cleanup();
 
-  free(aur->urlprefix);
+  for (i = 0; i < aur->nendpoints; i++) {
+    free(aur->endpoints[i].urlprefix);
+  }
+  free(aur->endpoints);
+  pthread_mutex_destroy(&aur->lock);
   free(aur);
 }
@@ -1,6 +1,9 @@
 #ifndef AUR_H
 #define AUR_H
 
+#include <pthread.h>
+#include <stdint.h>
+
 #include <curl/curl.h>
 
 typedef enum {
@@ -14,17 +17,50 @@ typedef enum {
   SEARCHBY_MAINTAINER,
 } rpc_by;
 
+struct aur_endpoint_t {
+  char *urlprefix;
+
+  /* smoothed time to first byte in microseconds */
+  double latency;
+  int measured;
+  int failures;
+  uint64_t down_until;
+  uint64_t last_used;
+};
+
 struct aur_t {
+  /* of the first endpoint, which URLs are built against */
   char *urlprefix;
 
   int rpc_version;
+
+  pthread_mutex_t lock;
+  struct aur_endpoint_t *endpoints;
+  int nendpoints;
 };
 typedef struct aur_t aur_t;
 
 int aur_new(const char *proto, const char *domain, aur_t **aur);
 void aur_free(aur_t *aur);
 
+/* Add a mirror or proxy which requests may be sent to instead. domain may
+ * carry its own scheme, e.g. http://localhost:8080, in which case proto is
+ * ignored. */
+int aur_add_endpoint(aur_t *aur, const char *proto, const char *domain);
+
+/* Choose the endpoint for a request: the fastest of those which haven't
+ * been failing lately, trying each one out first. */
+int aur_endpoint_pick(aur_t *aur);
+
+/* Rewrite a URL from one of the builders below to point at endpoint. */
+char *aur_endpoint_url(aur_t *aur, int endpoint, const char *url);
+
+/* Record how a request to endpoint went. latency is the time to the first
+ * byte of the response, in microseconds. */
+void aur_endpoint_report(aur_t *aur, int endpoint, int ok, uint64_t latency);
+
 char *aur_build_rpc_url(aur_t *aur, rpc_type type, rpc_by by, const char *arg);
+char *aur_build_rpc_info_url(aur_t *aur, const char **args, int nargs, int *consumed);
 char *aur_build_url(aur_t *aur, const char *urlpath);
 
 #endif  /* AUR_H */
@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "budget.h"
+#include "fs.h"
+
+#define BUDGET_MAGIC UINT64_C(0x746567647562776f)
+#define BUDGET_VERSION 1
+
+#define USEC_PER_DAY (24.0 * 60 * 60 * 1000000)
+
+/* The contents of the file. Every process sharing it must agree on this. */
+struct budget_state_t {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t reserved;
+  double tokens;
+  /* wall clock time of the last refill, in microseconds. the file outlives
+   * a reboot, which a monotonic clock doesn't. */
+  int64_t refilled;
+};
+
+struct budget_t {
+  /* fcntl locks are held by the process, so they don't keep its own
+   * threads out of each other's way */
+  pthread_mutex_t lock;
+  int fd;
+  struct budget_state_t *state;
+
+  double capacity;
+  /* tokens per microsecond */
+  double rate;
+};
+
+static int64_t now_usec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int lock_file(int fd, short type) {
+  struct flock fl = {
+    .l_type = type,
+    .l_whence = SEEK_SET,
+  };
+
+  while (fcntl(fd, F_SETLKW, &fl) < 0) {
+    if (errno != EINTR) {
+      return -errno;
+    }
+  }
+
+  return 0;
+}
+
+static void budget_lock(budget_t *budget) {
+  pthread_mutex_lock(&budget->lock);
+  /* the worst that can happen without it is a lost update, which isn't
+   * worth failing a request over */
+  lock_file(budget->fd, F_WRLCK);
+}
+
+static void budget_unlock(budget_t *budget) {
+  lock_file(budget->fd, F_UNLCK);
+  pthread_mutex_unlock(&budget->lock);
+}
+
+static void budget_refill(budget_t *budget) {
+  struct budget_state_t *state = budget->state;
+  const int64_t now = now_usec();
+
+  /* should the clock go backwards, just start counting again from now */
+  if (now > state->refilled) {
+    state->tokens += (now - state->refilled) * budget->rate;
+    if (state->tokens > budget->capacity) {
+      state->tokens = budget->capacity;
+    }
+  }
+
+  state->refilled = now;
+}
+
+int budget_open(const char *path, long per_day, budget_t **budget) {
+  struct budget_state_t *state;
+  struct stat st;
+  budget_t *b;
+  int fd, r;
+
+  if (per_day <= 0) {
+    return -EINVAL;
+  }
+
+  fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+  if (fd < 0 && errno == ENOENT) {
+    r = mkdir_parents(path);
+    if (r < 0) {
+      return r;
+    }
+    fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+  }
+  if (fd < 0) {
+    return -errno;
+  }
+
+  /* whoever gets here first sets the file up, while everyone else waits */
+  r = lock_file(fd, F_WRLCK);
+  if (r < 0) {
+    close(fd);
+    return r;
+  }
+
+  if (fstat(fd, &st) < 0 ||
+      (st.st_size < (off_t)sizeof(*state) && ftruncate(fd, sizeof(*state)) < 0)) {
+    r = -errno;
+    close(fd);
+    return r;
+  }
+
+  state = mmap(NULL, sizeof(*state), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (state == MAP_FAILED) {
+    r = -errno;
+    close(fd);
+    return r;
+  }
+
+  /* a new file, or one left by some other version of cower, starts full */
+  if (state->magic != BUDGET_MAGIC || state->version != BUDGET_VERSION) {
+    state->magic = BUDGET_MAGIC;
+    state->version = BUDGET_VERSION;
+    state->tokens = per_day;
+    state->refilled = now_usec();
+  }
+
+  lock_file(fd, F_UNLCK);
+
+  b = calloc(1, sizeof(*b));
+  if (b == NULL) {
+    munmap(state, sizeof(*state));
+    close(fd);
+    return -ENOMEM;
+  }
+
+  pthread_mutex_init(&b->lock, NULL);
+  b->fd = fd;
+  b->state = state;
+  b->capacity = per_day;
+  b->rate = per_day / USEC_PER_DAY;
+
+  *budget = b;
+  return 0;
+}
+
+void budget_close(budget_t *budget) {
+  if (budget == NULL) {
+    return;
+  }
+
+  munmap(budget->state, sizeof(*budget->state));
+  close(budget->fd);
+  pthread_mutex_destroy(&budget->lock);
+  free(budget);
+}
+
+long budget_take(budget_t *budget, double *remaining) {
+  double tokens;
+
+  budget_lock(budget);
+  budget_refill(budget);
+  tokens = --budget->state->tokens;
+  budget_unlock(budget);
+
+  if (remaining != NULL) {
+    *remaining = tokens;
+  }
+
+  if (tokens >= 0) {
+    return 0;
+  }
+
+  return (long)(-tokens / budget->rate / 1000) + 1;
+}
+
+int budget_try_take(budget_t *budget) {
+  int r = 0;
+
+  budget_lock(budget);
+  budget_refill(budget);
+  if (budget->state->tokens >= 1) {
+    budget->state->tokens--;
+    r = 1;
+  }
+  budget_unlock(budget);
+
+  return r;
+}
+
+void budget_refund(budget_t *budget) {
+  budget_lock(budget);
+  budget->state->tokens++;
+  if (budget->state->tokens > budget->capacity) {
+    budget->state->tokens = budget->capacity;
+  }
+  budget_unlock(budget);
+}
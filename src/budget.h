@@ -0,0 +1,33 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+/* A token bucket for requests to the AUR, kept in a small file which is
+ * mapped into every cower process that opens it, so that processes on one
+ * host draw from one budget. The bucket holds a day's worth of requests and
+ * refills continuously at that rate, which matches how the AUR counts.
+ *
+ * Taking from an empty bucket doesn't fail. The balance goes negative, and
+ * the taker is told how long to wait for the token it has reserved, so that
+ * requests are served in the order they asked no matter which process they
+ * come from. */
+typedef struct budget_t budget_t;
+
+int budget_open(const char *path, long per_day, budget_t **budget);
+void budget_close(budget_t *budget);
+
+/* Reserve a request. Returns how many milliseconds to wait before making it,
+ * and the balance left afterwards in *remaining, if not NULL.
+ *
+ * The reservation lives in the shared file, not in the process. If the
+ * process is killed while it waits, nothing refunds the reservation. Every
+ * later taker then waits behind it as well, until the bucket has refilled
+ * past it. That is at most as long as the killed process was going to wait. */
+long budget_take(budget_t *budget, double *remaining);
+
+/* Reserve a request only if it can be made right away. Returns 1 if so. */
+int budget_try_take(budget_t *budget);
+
+/* Give back a reservation which went unused. */
+void budget_refund(budget_t *budget);
+
+#endif  /* BUDGET_H */
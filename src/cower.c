@@ -27,18 +27,26 @@
 /* glibc */
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <float.h>
 #include <fnmatch.h>
 #include <getopt.h>
+#include <limits.h>
 #include <locale.h>
 #include <pthread.h>
 #include <pwd.h>
 #include <regex.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
 #include <wchar.h>
 #include <wordexp.h>
 
@@ -47,11 +55,24 @@
 #include <archive.h>
 #include <archive_entry.h>
 #include <curl/curl.h>
+#include <yajl/yajl_gen.h>
 #include <yajl/yajl_parse.h>
 
 #include "aur.h"
+#include "budget.h"
+#include "diskq.h"
+#include "flight.h"
+#include "limiter.h"
 #include "macro.h"
+#include "marker.h"
+#include "output.h"
 #include "package.h"
+#include "pkgcache.h"
+#include "srcinfo.h"
+#include "store.h"
+#include "strset.h"
+#include "throttle.h"
+#include "workq.h"
 
 /* macros */
 #define UNUSED                __attribute__((unused))
@@ -118,6 +139,14 @@ typedef enum __operation_t {
   OP_UPDATE   = (1 << 3),
 } operation_t;
 
+typedef enum __jsonmode_t {
+  JSON_NONE = 0,
+  /* a single array of every result */
+  JSON_ARRAY,
+  /* one object per line */
+  JSON_LINES,
+} jsonmode_t;
+
 enum {
   OP_DEBUG = 1000,
   OP_FORMAT,
@@ -131,6 +160,15 @@ enum {
   OP_NOIGNOREOOD,
   OP_AURDOMAIN,
   OP_SEARCHBY,
+  OP_CACHEDIR,
+  OP_OFFLINE,
+  OP_EXTRACTJOBS,
+  OP_RETRIES,
+  OP_HEDGE,
+  OP_DEADLINE,
+  OP_MAXRATE,
+  OP_JSON,
+  OP_NDJSON,
 };
 
 enum {
@@ -144,10 +182,87 @@ struct buffer_t {
   size_t capacity;
 };
 
+struct mapped_file_t {
+  char *data;
+  size_t size;
+};
+
+typedef enum {
+  FORMAT_LITERAL,
+  FORMAT_FIELD,
+  FORMAT_LIST,
+} format_op_kind;
+
+/* one step of a compiled --format string */
+struct format_op_t {
+  format_op_kind kind;
+
+  /* FORMAT_LITERAL: a span of format.text */
+  size_t offset;
+  size_t len;
+
+  /* FORMAT_FIELD: the conversion, and how to pad it */
+  char field;
+  int width;
+  int left;
+
+  /* FORMAT_LIST: where in the package the list is */
+  size_t list;
+};
+
+/* a fetched snapshot, on its way to the extraction stage */
+struct extract_job_t {
+  aurpkg_t *package;
+  struct buffer_t response;
+  struct marker_t marker;
+  char *etag;
+  /* the server said the snapshot is unchanged, so there's nothing to extract */
+  int unchanged;
+  /* add the package to the results once it's extracted */
+  int report;
+};
+
+struct file_loader_t {
+  pthread_mutex_t lock;
+  alpm_list_t *next;
+};
+
 struct task_t {
   struct aur_t *aur;
   CURL *curl;
   aurpkg_t **(*threadfn)(struct task_t*, const char*);
+  int worker;
+
+  /* where the body of the current transfer goes, and whether it's been
+   * sized from the Content-Length yet */
+  struct buffer_t *response;
+  int response_sized;
+  /* the transfer is a snapshot download, which the caller can resume */
+  int resumable;
+
+  /* for jittering retries */
+  unsigned int seed;
+  /* a request gave up because the run's deadline passed */
+  int timed_out;
+  /* the last rpc request got an answer, even if it was empty */
+  int rpc_answered;
+  /* the transfer's place in line for the --max-rate bandwidth */
+  double flow;
+
+  /* reused for every rpc response this worker receives */
+  struct buffer_t rpcbuf;
+};
+
+struct job_t {
+  const char *target;
+  /* NULL to run the task's threadfn */
+  aurpkg_t **(*fn)(struct task_t*, const char*);
+  /* if set, download this already resolved package instead */
+  aurpkg_t *package;
+  /* if set, look up this level of the dependency tree instead */
+  alpm_list_t *frontier;
+  /* results of dependency jobs are not reported */
+  int dependency;
 };
 
 /* function prototypes */
@@ -158,7 +273,10 @@ static alpm_list_t *alpm_find_foreign_pkgs(void);
 static alpm_handle_t *alpm_init(void);
 static int alpm_pkg_is_foreign(alpm_pkg_t*);
 static const char *alpm_provides_pkg(const char*);
-static int archive_extract_file(char *, size_t);
+static int archive_extract_entry(struct archive *, struct archive *, diskq_t *,
+    struct archive_entry *, struct buffer_t *);
+static int archive_extract_file(char *, size_t, diskq_t *, alpm_list_t **);
+static int archive_read_entry_data(struct archive *, struct buffer_t *);
 static int aurpkg_cmpver(const aurpkg_t *pkg1, const aurpkg_t *pkg2);
 static int aurpkg_cmpmaint(const aurpkg_t *pkg1, const aurpkg_t *pkg2);
 static int aurpkg_cmpvotes(const aurpkg_t *pkg1, const aurpkg_t *pkg2);
@@ -168,62 +286,206 @@ static int aurpkg_cmplastmod(const aurpkg_t *pkg1, const aurpkg_t *pkg2);
 static int aurpkg_cmpfirstsub(const aurpkg_t *pkg1, const aurpkg_t *pkg2);
 static int aurpkg_cmpname(const aurpkg_t *pkg1, const aurpkg_t *pkg2);
 static int aurpkg_cmp(const void*, const void*);
-static aurpkg_t **cower_perform(struct task_t *task, int num_threads);
+static int can_queue_file(diskq_t *q, int exists, const struct stat *st, mode_t perm);
+static aurpkg_t **cower_perform(struct task_t *task, int num_threads, int (*feedfn)(void), int *feedret);
+static int buffer_reserve(struct buffer_t *buf, size_t capacity);
 static size_t curl_buffer_response(void*, size_t, size_t, void*);
+static size_t curl_header_etag(char*, size_t, size_t, void*);
 static int cwr_fprintf(FILE*, loglevel_t, const char*, ...) __attribute__((format(printf,3,4)));
 static int cwr_printf(loglevel_t, const char*, ...) __attribute__((format(printf,2,3)));
 static int cwr_vfprintf(FILE*, loglevel_t, const char*, va_list) __attribute__((format(printf,3,0)));
+static long deadline_remaining(void);
 static aurpkg_t **dedupe_results(aurpkg_t **list);
 static aurpkg_t **download(struct task_t *task, const char*);
+static int download_package(struct task_t *task, aurpkg_t *package, int report);
+static void *extract_pool(void *arg);
+static void extract_job_free(struct extract_job_t *job);
+static diskq_t *extract_diskq_new(void);
+static void extract_snapshot(struct extract_job_t *job, diskq_t *q);
+static void finish_download(const aurpkg_t *package, int report);
+static int etag_is_strong(const char *etag);
+static int feed_targets_from_files(void);
+static int fetch_snapshot(struct task_t *task, const aurpkg_t *package,
+    const struct marker_t *marker, struct buffer_t *response, char **etag, long *response_code);
+static int file_has_contents(const char *path, const char *data, size_t size);
+static int feed_targets_from_stdin(void);
+static void *file_loader(void *arg);
 static aurpkg_t **filter_results(aurpkg_t **);
+static aurpkg_t **package_list_new(aurpkg_t *package);
 static int find_search_fragment(const char *, char **);
 static char *get_file_as_buffer(const char*);
+static int get_cache_path(char *cache_path, size_t pathlen);
 static int getcols(void);
 static int get_config_path(char *config_path, size_t pathlen);
 static int globcompare(const void *a, const void *b);
+static int http_should_retry(CURLcode r, long response_code);
 static int have_unignored_results(aurpkg_t **packages);
+static void json_close(void);
+static int json_open(void);
+static int hedge_acquire(uint64_t *token);
+static void hedge_release(uint64_t token);
 static void indentprint(const char*, int);
-static alpm_list_t *load_targets_from_files(alpm_list_t *files);
+static curl_off_t latency_p95(void);
+static void latency_record(curl_off_t usec);
+static int load_depends_from_file(const char *path, alpm_list_t **deplist);
+static const char *machine_arch(void);
+static int map_file(const char *path, struct mapped_file_t *file);
+static aurpkg_t *offline_package(const char *name);
+static void open_budget(void);
+static int open_store(void);
+static int marker_matches(const struct marker_t *marker, const aurpkg_t *package);
 static alpm_list_t *parse_bash_array(alpm_list_t*, char*);
 static int parse_configfile(void);
 static int parse_options(int, char*[]);
 static int parse_keyname(char*);
+static int parse_rate(const char *, long *);
 static int pkg_is_binary(const char *pkg);
 static void pkgbuild_get_depends(char*, alpm_list_t**);
-static int print_escaped(const char*);
-static void print_extinfo_list(char **, const char*, const char*, int);
-static void print_colored(const char *fieldname, const char *color, const char *value);
+static void remove_stale_files(const alpm_list_t *previous, const alpm_list_t *current);
+static void print_extinfo_list(char **, const char*, int);
+static void print_colored(const char *fieldname, const char *color, size_t colorlen,
+    const char *value);
 static void print_time(const char *fieldname, time_t* timestamp);
+static int format_compile(const char *, const char *);
+static void format_field(const struct format_op_t *, const aurpkg_t *);
+static void format_free(void);
+static int format_literal(char);
 static void print_pkg_formatted(aurpkg_t*);
 static void print_pkg_info(aurpkg_t*);
 static void print_pkg_installed_tag(aurpkg_t*);
+static void print_pkg_json(aurpkg_t*);
 static void print_pkg_search(aurpkg_t*);
 static void print_results(aurpkg_t **, void (*)(aurpkg_t*));
-static int read_targets_from_file(FILE *in, alpm_list_t **targets);
-static void resolve_one_dep(struct task_t *task, const char *depend);
-static void resolve_pkg_dependencies(struct task_t *task, aurpkg_t *package);
+static int read_targets_from_file(int fd);
+static void release_limiter(CURL *curl, uint64_t token, CURLcode r, int counted, const char *arg);
+static void remember_package(const aurpkg_t *package);
+static void report_unresolved(const char *target);
+static void resolve_frontier(alpm_list_t *frontier, struct task_t *task);
+static void resolve_one_dep(const char *depend);
+static void resolve_pkg_dependencies(aurpkg_t *package);
+static int resolve_srcinfo_dependencies(aurpkg_t *package);
+static void resolver_job_done(struct task_t *task);
+static long retry_delay(struct task_t *task, int attempt);
+static int queue_extract(struct extract_job_t *job);
+static int queue_file(diskq_t *q, struct archive_entry *entry, struct buffer_t *buf);
 static rpc_type rpc_op_from_opmask(int opmask);
 static aurpkg_t **rpc_do(struct task_t *task, rpc_type type, const char *arg);
+static aurpkg_t **rpc_do_url(struct task_t *task, const char *url, const char *arg);
+static aurpkg_t **rpc_info(struct task_t *task, const char *name);
 static int ch_working_dir(void);
+static int queue_level(alpm_list_t *frontier);
+static int queue_job(int worker, const char *target,
+    aurpkg_t **(*fn)(struct task_t*, const char*), aurpkg_t *package, int dependency);
+static int schedule_target(const char *target, size_t len);
 static int should_ignore_package(const aurpkg_t *package, regex_t *pattern);
+static int snapshot_claim(const char *pkgbase, int *result);
+static void snapshot_release(const char *pkgbase, int result);
+static int srcinfo_load_depends(const char *path, const char *pkgname, alpm_list_t **deplist);
+static char *srcinfo_path_for(const char *path);
+static void stream_close(void);
+static int stream_open(void (*printfn)(aurpkg_t*));
+static void stream_results(aurpkg_t **packages);
 static void strings_init(void);
 static size_t strtrim(char*);
 static int task_http_execute(struct task_t *, const char *, const char *);
-static void task_reset(struct task_t *, const char *, void *);
-static void task_reset_for_download(struct task_t *, const char *, void *);
-static void task_reset_for_rpc(struct task_t *, const char *, void *);
+static void task_reset(struct task_t *, const char *, struct buffer_t *);
+static int task_spend_budget(struct task_t *, const char *);
+static void task_reset_for_download(struct task_t *, const char *, struct buffer_t *);
+static void task_reset_for_rpc(struct task_t *, const char *, struct buffer_t *);
 static aurpkg_t **task_download(struct task_t*, const char*);
+static aurpkg_t **task_download_package(struct task_t *task, aurpkg_t *package);
+static CURLcode task_perform(struct task_t *task, const char *arg);
+static CURLcode task_perform_hedged(struct task_t *task, curl_off_t threshold, uint64_t token,
+    const char *arg);
 static aurpkg_t **task_query(struct task_t*, const char*);
 static aurpkg_t **task_update(struct task_t*, const char*);
 static void *thread_pool(void*);
+static void unmap_file(struct mapped_file_t *file);
+static void update_marker(const aurpkg_t *package, const char *etag, alpm_list_t *files);
 static void usage(void);
 static void version(void);
 
 /* globals */
 static alpm_handle_t *pmhandle;
 static alpm_db_t *db_local;
-static alpm_list_t *workq;
-static pthread_mutex_t listlock = PTHREAD_MUTEX_INITIALIZER;
+static workq_t *workq;
+static strset_t *scheduled;
+static pkgcache_t *infocache;
+static store_t *store;
+static workq_t *extractq;
+static limiter_t *limiter;
+static budget_t *budget;
+static throttle_t *throttle;
+/* results go out through here, by one thread at a time */
+static output_t *output;
+/* for --json and --ndjson, writing into output */
+static yajl_gen jsongen;
+
+/* --format, compiled once into the steps to take for each package */
+static struct {
+  struct format_op_t *ops;
+  size_t count;
+  /* literal text and the list delimiter, with escapes already expanded */
+  char *text;
+  size_t textlen;
+  /* the delimiter comes first in text */
+  size_t delim_len;
+} format;
+
+/* when the run must be over, if there's a --deadline */
+static struct timespec deadline_at;
+
+/* targets which the deadline cut off */
+static struct {
+  pthread_mutex_t lock;
+  alpm_list_t *targets;
+} unresolved = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+/* results printed as each request finishes, rather than sorted at the end */
+static struct {
+  pthread_mutex_t lock;
+  void (*printfn)(aurpkg_t*);
+  /* names printed so far */
+  strset_t *seen;
+  /* every target a search result must match */
+  regex_t *patterns;
+  int npatterns;
+  /* the user's LC_NUMERIC, which the rest of the process doesn't have yet */
+  locale_t locale;
+  int failed;
+} stream = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* total time taken by recent rpc requests, in microseconds */
+static struct {
+  pthread_mutex_t lock;
+  curl_off_t samples[128];
+  size_t count;
+  size_t next;
+} rpc_latency = { PTHREAD_MUTEX_INITIALIZER, { 0 }, 0, 0 };
+
+/* packages downloaded by the extraction stage, to be reported */
+static struct {
+  pthread_mutex_t lock;
+  aurpkg_t **packages;
+} downloaded = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* breadth first dependency resolution for -dd */
+static struct {
+  pthread_mutex_t lock;
+  /* dependencies found on the current level, awaiting a batched lookup */
+  alpm_list_t *frontier;
+  /* queued or running jobs, any of which may add to the frontier */
+  int inflight;
+} resolver = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* snapshots fetched or being fetched this run, keyed by pkgbase, so split
+ * packages sharing a pkgbase only ever download it once. each outcome is the
+ * result of download_package for whoever claimed it. */
+static flight_t *snapshots;
 
 static const int kInfoIndent = 17;
 static const int kSearchIndent = 4;
@@ -233,6 +495,21 @@ static const char kCowerUserAgent[] = "cower/" COWER_VERSION;
 static const char kRegexChars[] = "^.+*?$[](){}|\\";
 static const char kDigits[] = "0123456789";
 static const char kPrintfFlags[] = "'-+ #0I";
+static const size_t kOutputBufferSize = 64 * 1024;
+static const int kMaxResumeAttempts = 3;
+static const int kInitialConcurrency = 2;
+/* fetched snapshots allowed to wait for each extraction worker */
+static const int kExtractBacklog = 4;
+/* retry delays in ms, before jitter */
+static const long kRetryBaseDelay = 250L;
+static const long kRetryMaxDelay = 8000L;
+/* without a deadline, the longest a server may ask us to wait before a retry */
+static const long kRetryAfterMax = 120000L;
+static const size_t kHedgeMinSamples = 20;
+/* don't take a server's word for anything bigger than this */
+static const curl_off_t kMaxPresize = 64 << 20;
+/* MiB for the snapshot store, once someone has asked for one */
+static const long kDefaultCacheSize = 256L;
 
 static struct {
   const char *error;
@@ -256,28 +533,57 @@ static struct {
   .nc = ""
 };
 
+/* lengths of the colours above which go into results, worked out once */
+static struct {
+  size_t pkg;
+  size_t repo;
+  size_t url;
+  size_t ood;
+  size_t utd;
+  size_t nc;
+} collen;
+
 /* runtime configuration */
 static struct {
+  /* for links to package pages */
   const char *aur_domain;
+  /* where requests go, in order of preference */
+  alpm_list_t *domains;
   rpc_by search_by;
 
   char *working_dir;
+  char *cache_dir;
   const char *delim;
   const char *format;
 
   operation_t opmask;
   loglevel_t logmask;
+  jsonmode_t json;
 
   short color;
   short ignoreood;
   short sortorder;
+  int sorted:1;
   int force:1;
   int getdeps:1;
   int quiet:1;
   int skiprepos:1;
   int frompkgbuild:1;
+  int offline:1;
+  int sync_extract:1;
+  int hedge:1;
   int maxthreads;
+  int extract_jobs;
+  int retries;
   long timeout;
+  long deadline;
+  long lowspeed_limit;
+  long lowspeed_time;
+  long cache_size;
+  long buffer_highwater;
+  long request_budget;
+  long max_rate;
+  char *budget_file;
 
   int (*sort_fn)(const aurpkg_t*, const aurpkg_t*);
 
@@ -291,8 +597,13 @@ static struct {
   .search_by = SEARCHBY_NAME_DESC,
   .sortorder = SORT_FORWARD,
   .timeout = 10L,
+  .lowspeed_limit = 1L,
+  .lowspeed_time = 30L,
   .delim = kListDelim,
   .maxthreads = 10,
+  .retries = 3,
+  .cache_size = -1L,
+  .buffer_highwater = 1024L,
   .logmask = LOG_ERROR|LOG_WARN|LOG_INFO,
   .sort_fn = aurpkg_cmpname,
 };
@@ -422,38 +733,213 @@ const char *alpm_provides_pkg(const char *pkgname) {
   return dbname;
 }
 
-int archive_extract_file(char *data, size_t size) {
-  struct archive *archive;
+/* Read the rest of the current entry into buf, replacing its contents. */
+int archive_read_entry_data(struct archive *archive, struct buffer_t *buf) {
+  buf->size = 0;
+
+  for (;;) {
+    la_ssize_t n;
+
+    if (buf->capacity - buf->size < BUFSIZ) {
+      const size_t newcap = buf->capacity ? buf->capacity * 2 : 4 * BUFSIZ;
+      char *newdata = realloc(buf->data, newcap);
+
+      if (newdata == NULL) {
+        return ENOMEM;
+      }
+
+      buf->data = newdata;
+      buf->capacity = newcap;
+    }
+
+    n = archive_read_data(archive, buf->data + buf->size, buf->capacity - buf->size);
+    if (n < 0) {
+      return archive_errno(archive);
+    } else if (n == 0) {
+      return 0;
+    }
+
+    buf->size += n;
+  }
+}
+
+int file_has_contents(const char *path, const char *data, size_t size) {
+  struct mapped_file_t file;
+  int same;
+
+  if (map_file(path, &file) < 0) {
+    return 0;
+  }
+
+  same = file.size == size && (size == 0 || memcmp(file.data, data, size) == 0);
+  unmap_file(&file);
+
+  return same;
+}
+
+/* Whether a regular file can be written through the disk queue rather than
+ * libarchive. It must either not exist yet, or be a file of its own that
+ * already has the right permissions, since the queue can't chmod. */
+int can_queue_file(diskq_t *q, int exists, const struct stat *st, mode_t perm) {
+  if (q == NULL) {
+    return 0;
+  } else if (!exists) {
+    return diskq_mode_ok(perm);
+  }
+
+  return S_ISREG(st->st_mode) && st->st_nlink == 1 && (st->st_mode & 07777) == perm;
+}
+
+int queue_file(diskq_t *q, struct archive_entry *entry, struct buffer_t *buf) {
+  struct timespec times[2];
+  int r;
+
+  times[0].tv_sec = archive_entry_atime(entry);
+  times[0].tv_nsec = archive_entry_atime_is_set(entry) ?
+      archive_entry_atime_nsec(entry) : UTIME_NOW;
+  times[1].tv_sec = archive_entry_mtime(entry);
+  times[1].tv_nsec = archive_entry_mtime_is_set(entry) ?
+      archive_entry_mtime_nsec(entry) : UTIME_OMIT;
+
+  /* the queue owns the data until it's flushed */
+  r = diskq_add(q, archive_entry_pathname(entry), archive_entry_perm(entry) & 07777,
+      times, buf->data, buf->size);
+  buf->data = NULL;
+  buf->size = buf->capacity = 0;
+
+  return -r;
+}
+
+/* Write an entry out, unless what's already on disk is identical to it.
+ * Leaving unchanged files alone preserves their mtimes, so rebuilds from a
+ * refreshed snapshot only see what actually changed. */
+int archive_extract_entry(struct archive *archive, struct archive *disk, diskq_t *q,
+    struct archive_entry *entry, struct buffer_t *buf) {
+  const char *entryname = archive_entry_pathname(entry);
+  const mode_t type = archive_entry_filetype(entry);
+  struct stat st;
+  int unchanged = 0, exists, r;
+
+  if (type == AE_IFREG) {
+    const mode_t perm = archive_entry_perm(entry) & 07777;
+
+    r = archive_read_entry_data(archive, buf);
+    if (r != 0) {
+      return r;
+    }
+
+    exists = lstat(entryname, &st) == 0;
+    unchanged = exists && S_ISREG(st.st_mode) &&
+        (size_t)st.st_size == buf->size &&
+        (st.st_mode & 07777) == perm &&
+        file_has_contents(entryname, buf->data, buf->size);
+
+    if (!unchanged && can_queue_file(q, exists, &st, perm)) {
+      cwr_printf(LOG_DEBUG, "extracting file: %s\n", entryname);
+      return queue_file(q, entry, buf);
+    }
+  } else if (type == AE_IFLNK) {
+    char target[PATH_MAX];
+    ssize_t len = readlink(entryname, target, sizeof(target) - 1);
+
+    if (len >= 0) {
+      target[len] = '\0';
+      unchanged = streq(target, archive_entry_symlink(entry));
+    }
+  }
+
+  if (unchanged) {
+    cwr_printf(LOG_DEBUG, "unchanged file: %s\n", entryname);
+    return 0;
+  }
+
+  cwr_printf(LOG_DEBUG, "extracting file: %s\n", entryname);
+
+  /* anything queued must land first, in case this entry depends on it or
+   * replaces it */
+  if (q != NULL) {
+    r = diskq_flush(q);
+    if (r < 0) {
+      return -r;
+    }
+  }
+
+  r = archive_write_header(disk, entry);
+  if (r == ARCHIVE_OK && type == AE_IFREG && buf->size > 0) {
+    if (archive_write_data(disk, buf->data, buf->size) < 0) {
+      r = ARCHIVE_FATAL;
+    }
+  }
+
+  if (r == ARCHIVE_OK) {
+    r = archive_write_finish_entry(disk);
+  }
+
+  /* ARCHIVE_FAILED skips just this entry, but it still didn't land, and
+   * mustn't end up in the marker as if it had */
+  if (r < ARCHIVE_OK) {
+    r = archive_errno(disk);
+    return r != 0 ? r : EIO;
+  }
+
+  return 0;
+}
+
+/* q batches file writes, or is NULL to leave them all to libarchive */
+int archive_extract_file(char *data, size_t size, diskq_t *q, alpm_list_t **files) {
+  struct archive *archive, *disk;
   struct archive_entry *entry;
+  struct buffer_t buf = { NULL, 0, 0 };
   const int archive_flags = ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_TIME;
-  int r = 0;
+  int r = 0, k;
 
   archive = archive_read_new();
   archive_read_support_filter_all(archive);
   archive_read_support_format_all(archive);
 
   if (archive_read_open_memory(archive, data, size) != ARCHIVE_OK) {
-    return archive_errno(archive);
+    r = archive_errno(archive);
+    archive_read_free(archive);
+    return r;
   }
 
+  /* one writer for the whole tarball, rather than one per entry */
+  disk = archive_write_disk_new();
+  archive_write_disk_set_options(disk, archive_flags);
+  archive_write_disk_set_standard_lookup(disk);
+
   while (archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
     const char *entryname = archive_entry_pathname(entry);
+    const mode_t type = archive_entry_filetype(entry);
 
-    cwr_printf(LOG_DEBUG, "extracting file: %s\n", entryname);
-
-    r = archive_read_extract(archive, entry, archive_flags);
-    /* NOOP ON ARCHIVE_{OK,WARN,RETRY} */
-    if (r == ARCHIVE_FATAL || r == ARCHIVE_WARN) {
-      r = archive_errno(archive);
-      break;
-    } else if (r == ARCHIVE_EOF) {
-      r = 0;
+    r = archive_extract_entry(archive, disk, q, entry, &buf);
+    if (r != 0) {
       break;
     }
+
+    /* remembered so that a later snapshot can tell what it no longer has */
+    if ((type == AE_IFREG || type == AE_IFLNK) && strchr(entryname, '\n') == NULL) {
+      char *file = strdup(entryname);
+
+      if (file != NULL) {
+        *files = alpm_list_add(*files, file);
+      }
+    }
   }
 
+  /* before libarchive fixes up directory timestamps on close */
+  if (q != NULL) {
+    k = diskq_flush(q);
+    if (r == 0) {
+      r = -k;
+    }
+  }
+
+  archive_write_close(disk);
+  archive_write_free(disk);
   archive_read_close(archive);
   archive_read_free(archive);
+  free(buf.data);
 
   return r;
 }
@@ -580,255 +1066,1150 @@ int cwr_vfprintf(FILE *stream, loglevel_t level, const char *format, va_list arg
   return vfprintf(stream, bufout, args);
 }
 
-void task_reset(struct task_t *task, const char *url, void *writedata) {
+void task_reset(struct task_t *task, const char *url, struct buffer_t *response) {
   curl_easy_reset(task->curl);
 
+  task->response = response;
+  task->response_sized = 0;
+  task->resumable = 0;
+  task->flow = 0;
+
   curl_easy_setopt(task->curl, CURLOPT_URL, url);
   curl_easy_setopt(task->curl, CURLOPT_WRITEFUNCTION, curl_buffer_response);
-  curl_easy_setopt(task->curl, CURLOPT_WRITEDATA, writedata);
+  curl_easy_setopt(task->curl, CURLOPT_WRITEDATA, task);
   curl_easy_setopt(task->curl, CURLOPT_USERAGENT, kCowerUserAgent);
   curl_easy_setopt(task->curl, CURLOPT_CONNECTTIMEOUT, cfg.timeout);
   curl_easy_setopt(task->curl, CURLOPT_FOLLOWLOCATION, 1L);
 
-  /* Required for multi-threaded apps using timeouts. See
-   * CURLOPT_NOSIGNAL(3) */
+  /* Required for multi-threaded apps using timeouts, and every request can
+   * have one, if only from the deadline. See CURLOPT_NOSIGNAL(3) */
+  curl_easy_setopt(task->curl, CURLOPT_NOSIGNAL, 1L);
+
   if (cfg.timeout > 0L) {
-    curl_easy_setopt(task->curl, CURLOPT_NOSIGNAL, 1L);
+    /* give up on a connection which has stopped delivering anything, so
+     * that it can be retried rather than holding up the whole run */
+    curl_easy_setopt(task->curl, CURLOPT_LOW_SPEED_LIMIT, cfg.lowspeed_limit);
+    curl_easy_setopt(task->curl, CURLOPT_LOW_SPEED_TIME, cfg.lowspeed_time);
   }
 }
 
-void task_reset_for_rpc(struct task_t *task, const char *url, void *writedata) {
-  task_reset(task, url, writedata);
+void task_reset_for_rpc(struct task_t *task, const char *url, struct buffer_t *response) {
+  task_reset(task, url, response);
 
   /* The empty string indicates that we should accept any supported encoding. */
   curl_easy_setopt(task->curl, CURLOPT_ACCEPT_ENCODING, "");
 }
 
-void task_reset_for_download(struct task_t *task, const char *url, void *writedata) {
-  task_reset(task, url, writedata);
+void task_reset_for_download(struct task_t *task, const char *url, struct buffer_t *response) {
+  task_reset(task, url, response);
+  task->resumable = 1;
 
   /* disable compression, since downloads are compressed tarballs */
   curl_easy_setopt(task->curl, CURLOPT_ACCEPT_ENCODING, "identity");
 }
 
+int buffer_reserve(struct buffer_t *buf, size_t capacity) {
+  char *newdata;
+
+  if (capacity <= buf->capacity) {
+    return 0;
+  }
+
+  newdata = realloc(buf->data, capacity);
+  if (newdata == NULL) {
+    return -ENOMEM;
+  }
+
+  buf->data = newdata;
+  buf->capacity = capacity;
+
+  return 0;
+}
+
 size_t curl_buffer_response(void *ptr, size_t size, size_t nmemb, void *userdata) {
   const size_t realsize = size * nmemb;
-  struct buffer_t *mem = userdata;
+  struct task_t *task = userdata;
+  struct buffer_t *mem = task->response;
+
+  /* when the server says how much is coming, make room for all of it at
+   * once. it's only a hint: compressed responses decode to more. */
+  if (!task->response_sized) {
+    curl_off_t length;
+
+    task->response_sized = 1;
+    if (curl_easy_getinfo(task->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length) == CURLE_OK &&
+        length > 0 && length <= kMaxPresize) {
+      buffer_reserve(mem, mem->size + length + 1);
+    }
+  }
+
+  if (mem->size + realsize >= mem->capacity) {
+    size_t newcap = mem->capacity * 2;
 
-  if (mem->data == NULL || mem->capacity - realsize <= mem->size) {
-    char *newdata;
-    const size_t newcap = (mem->capacity + realsize) * 2.5;
+    if (newcap < mem->size + realsize + 1) {
+      newcap = mem->size + realsize + 1;
+    }
 
-    newdata = realloc(mem->data, newcap);
-    if (newdata == NULL) {
+    if (buffer_reserve(mem, newcap) < 0) {
       cwr_fprintf(stderr, LOG_ERROR, "failed to reallocate %zd bytes\n",
           mem->size + realsize);
       return 0;
     }
-
-    mem->capacity = newcap;
-    mem->data = newdata;
   }
 
   memcpy(mem->data + mem->size, ptr, realsize);
   mem->size += realsize;
   mem->data[mem->size] = '\0';
 
+  /* rpc responses are small, and someone is usually waiting on them */
+  if (throttle != NULL) {
+    throttle_consume(throttle, &task->flow, realsize, !task->resumable);
+  }
+
   return realsize;
 }
 
-int task_http_execute(struct task_t *task, const char *url, const char *arg) {
-  CURLcode r;
-  long response_code;
-
-  cwr_printf(LOG_DEBUG, "[%s]: curl_easy_perform %s\n", arg, url);
+size_t curl_header_etag(char *ptr, size_t size, size_t nmemb, void *userdata) {
+  const size_t realsize = size * nmemb;
+  char **etag = userdata;
+  size_t len;
 
-  r = curl_easy_perform(task->curl);
-  if (r != CURLE_OK) {
-    cwr_fprintf(stderr, LOG_ERROR, "[%s]: %s\n", arg, curl_easy_strerror(r));
-    return 1;
+  if (realsize <= 5 || strncasecmp(ptr, "etag:", 5) != 0) {
+    return realsize;
   }
 
-  curl_easy_getinfo(task->curl, CURLINFO_RESPONSE_CODE, &response_code);
-  cwr_printf(LOG_DEBUG, "[%s]: server responded with %ld\n", arg, response_code);
-
-  if (response_code != 200) {
-    cwr_fprintf(stderr, LOG_ERROR, "[%s]: server responded with HTTP %ld\n",
-        arg, response_code);
-    return 1;
+  ptr += 5;
+  len = realsize - 5;
+  while (len > 0 && (*ptr == ' ' || *ptr == '\t')) {
+    ptr++;
+    len--;
   }
-
-  return 0;
-}
-
-aurpkg_t **download(struct task_t *task, const char *package) {
-  aurpkg_t **result;
-  _cleanup_free_ char *url = NULL;
-  int ret;
-  struct buffer_t response = { NULL, 0, 0 };
-
-  result = rpc_do(task, RPC_INFO, package);
-  if (!result) {
-    cwr_fprintf(stderr, LOG_ERROR, "no results found for %s\n", package);
-    return NULL;
+  while (len > 0 && (ptr[len - 1] == '\r' || ptr[len - 1] == '\n' || ptr[len - 1] == ' ')) {
+    len--;
   }
 
-  cwr_printf(LOG_DEBUG, "package %s is part of pkgbase %s\n", package, result[0]->pkgbase);
-
-  if (access(result[0]->pkgbase, F_OK) == 0 && !cfg.force) {
-    cwr_fprintf(stderr, LOG_ERROR, "`%s/%s' already exists. Use -f to overwrite.\n",
-        cfg.working_dir, result[0]->pkgbase);
-    aur_packages_free(result);
-    return NULL;
-  }
+  /* redirects mean we may see more than one; the last one wins */
+  free(*etag);
+  *etag = len > 0 ? strndup(ptr, len) : NULL;
 
-  url = aur_build_url(task->aur, result[0]->aur_urlpath);
-  if (url == NULL) {
-    return NULL;
-  }
+  return realsize;
+}
 
-  task_reset_for_download(task, url, &response);
-  if (task_http_execute(task, url, package) != 0) {
-    goto finish;
+/* Hand the outcome of a request to the limiter. counted is zero for a
+ * request which lost a race, and so says nothing about how long it took. */
+void release_limiter(CURL *curl, uint64_t token, CURLcode r, int counted, const char *arg) {
+  limiter_outcome outcome = LIMITER_IGNORE;
+  curl_off_t pretransfer = 0, starttransfer = 0;
+  long response_code = 0;
+  int limit;
+
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+  if (r == CURLE_OPERATION_TIMEDOUT || response_code == 429 || response_code == 503) {
+    outcome = LIMITER_DROPPED;
+  } else if (r == CURLE_OK && counted) {
+    outcome = LIMITER_OK;
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
   }
 
-  ret = archive_extract_file(response.data, response.size);
-  if (ret != 0) {
-    cwr_fprintf(stderr, LOG_ERROR, "[%s]: failed to extract tarball: %s\n",
-        package, strerror(ret));
-    goto finish;
+  /* time to first byte, less connection setup, so that neither new
+   * connections nor big tarballs look like a server under load */
+  limit = limiter_release(limiter, token, outcome,
+      starttransfer > pretransfer ? (uint64_t)(starttransfer - pretransfer) : 0);
+  if (limit > 0) {
+    cwr_printf(LOG_DEBUG, "[%s]: concurrency limit is now %d\n", arg, limit);
   }
+}
 
-  cwr_printf(LOG_INFO, "%s%s%s downloaded to %s\n",
-      colstr.pkg, result[0]->name, colstr.nc, cfg.working_dir);
-
-  if (cfg.getdeps) {
-    resolve_pkg_dependencies(task, result[0]);
+void latency_record(curl_off_t usec) {
+  pthread_mutex_lock(&rpc_latency.lock);
+  rpc_latency.samples[rpc_latency.next] = usec;
+  rpc_latency.next = (rpc_latency.next + 1) % ARRAYSIZE(rpc_latency.samples);
+  if (rpc_latency.count < ARRAYSIZE(rpc_latency.samples)) {
+    rpc_latency.count++;
   }
-
-finish:
-  free(response.data);
-
-  return result;
+  pthread_mutex_unlock(&rpc_latency.lock);
 }
 
-/* TODO: rewrite comparators to avoid this duplication */
-static int aurpkgp_cmpname(const void *a, const void *b) {
-  const aurpkg_t *const *p1 = a;
-  const aurpkg_t *const *p2 = b;
+static int latency_cmp(const void *a, const void *b) {
+  const curl_off_t *l1 = a, *l2 = b;
 
-  return aurpkg_cmpname(*p1, *p2);
+  return (*l1 > *l2) - (*l1 < *l2);
 }
 
-aurpkg_t **dedupe_results(aurpkg_t **packages) {
-  aurpkg_t *prev = NULL;
-  int i, len;
-
-  if (packages == NULL) {
-    return NULL;
-  }
-
-  len = aur_packages_count(packages);
+/* The 95th percentile of recent rpc latencies, or 0 if there haven't been
+ * enough requests to say. */
+curl_off_t latency_p95(void) {
+  curl_off_t samples[ARRAYSIZE(rpc_latency.samples)];
+  size_t count;
 
-  qsort(packages, len, sizeof(*packages), aurpkgp_cmpname);
+  pthread_mutex_lock(&rpc_latency.lock);
+  count = rpc_latency.count;
+  memcpy(samples, rpc_latency.samples, count * sizeof(*samples));
+  pthread_mutex_unlock(&rpc_latency.lock);
 
-  for (i = 0; i < len; i++) {
-    if (prev == NULL || aurpkg_cmpname(packages[i], prev) != 0) {
-      prev = packages[i];
-    } else {
-      packages[i]->ignored = 1;
-    }
+  if (count < kHedgeMinSamples) {
+    return 0;
   }
 
-  return packages;
+  qsort(samples, count, sizeof(*samples), latency_cmp);
+
+  return samples[count * 95 / 100];
 }
 
-int should_ignore_package(const aurpkg_t *package, regex_t *pattern) {
-  if ((cfg.search_by == SEARCHBY_NAME || cfg.search_by == SEARCHBY_NAME_DESC) &&
-      regexec(pattern, package->name, 0, 0, 0) != REG_NOMATCH) {
+/* Never push harder than the limiter allows, nor dip into the budget for a
+ * request which would have to wait its turn. */
+int hedge_acquire(uint64_t *token) {
+  if (limiter != NULL && !limiter_try_acquire(limiter, token)) {
     return 0;
   }
 
-  if (cfg.search_by == SEARCHBY_NAME_DESC && package->description &&
-      regexec(pattern, package->description, 0, 0, 0) != REG_NOMATCH) {
+  if (budget != NULL && !budget_try_take(budget)) {
+    if (limiter != NULL) {
+      limiter_release(limiter, *token, LIMITER_IGNORE, 0);
+    }
     return 0;
   }
 
   return 1;
 }
 
-aurpkg_t **filter_results(aurpkg_t **packages) {
-  if (packages == NULL) {
-    return NULL;
+void hedge_release(uint64_t token) {
+  if (limiter != NULL) {
+    limiter_release(limiter, token, LIMITER_IGNORE, 0);
+  }
+  if (budget != NULL) {
+    budget_refund(budget);
   }
+}
 
-  dedupe_results(packages);
+/* Run the transfer, and should it take longer than threshold microseconds,
+ * race a duplicate of it on a fresh connection. Whichever finishes first is
+ * left in task->curl and task->response. Each request reports back to the
+ * limiter under its own token, the primary's being token, and only the
+ * winner's latency counts. */
+CURLcode task_perform_hedged(struct task_t *task, curl_off_t threshold, uint64_t token,
+    const char *arg) {
+  struct task_t shadow;
+  struct buffer_t hedgebuf = { NULL, 0, 0 };
+  struct timespec started, now;
+  CURL *primary = task->curl, *hedge = NULL, *winner = NULL;
+  CURLM *multi;
+  CURLcode r = CURLE_OK;
+  uint64_t hedgetoken = 0;
+  int running = 1, outstanding = 1;
+
+  multi = curl_multi_init();
+  if (multi == NULL) {
+    r = curl_easy_perform(task->curl);
+    if (limiter != NULL) {
+      release_limiter(task->curl, token, r, 1, arg);
+    }
+    return r;
+  }
 
-  if (allow_regex()) {
-    const alpm_list_t *i;
+  curl_multi_add_handle(multi, task->curl);
+  clock_gettime(CLOCK_MONOTONIC, &started);
 
-    for (i = cfg.targets; i; i = i->next) {
-      regex_t regex;
-      aurpkg_t **p;
+  while (winner == NULL) {
+    CURLMsg *msg;
+    int left, timeout = 100;
 
-      /* this should succeed since we validated the regex up front */
-      regcomp(&regex, i->data, kRegexOpts);
+    curl_multi_perform(multi, &running);
 
-      for (p = packages; *p; p++) {
-        aurpkg_t *pkg = *p;
+    while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
 
-        if (pkg->ignored || (pkg->ignored = should_ignore_package(pkg, &regex))) {
-          continue;
-        }
+      /* a failure only counts once there's nothing left to wait for */
+      outstanding--;
+      if (msg->data.result == CURLE_OK || outstanding == 0) {
+        winner = msg->easy_handle;
+        r = msg->data.result;
+        break;
       }
-      regfree(&regex);
     }
-  }
 
-  return packages;
-}
+    if (winner != NULL) {
+      break;
+    }
 
-int getcols(void) {
-  int c;
-  struct winsize ws;
-  static int cached_columns = -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (hedge == NULL && threshold > 0) {
+      const curl_off_t elapsed = (curl_off_t)(now.tv_sec - started.tv_sec) * 1000000 +
+          (now.tv_nsec - started.tv_nsec) / 1000;
+
+      if (elapsed >= threshold) {
+        threshold = 0;
+        if (hedge_acquire(&hedgetoken)) {
+          hedge = curl_easy_duphandle(task->curl);
+          if (hedge != NULL) {
+            cwr_printf(LOG_DEBUG, "[%s]: no response after %ld ms, hedging\n", arg,
+                (long)(elapsed / 1000));
+            shadow = *task;
+            shadow.curl = hedge;
+            shadow.response = &hedgebuf;
+            shadow.response_sized = 0;
+            curl_easy_setopt(hedge, CURLOPT_WRITEDATA, &shadow);
+            curl_multi_add_handle(multi, hedge);
+            outstanding++;
+          } else {
+            hedge_release(hedgetoken);
+          }
+        }
+      } else {
+        timeout = (int)((threshold - elapsed) / 1000) + 1;
+      }
+    }
 
-  if (cached_columns >= 0) {
-    return cached_columns;
+    curl_multi_poll(multi, NULL, 0, timeout, NULL);
   }
 
-  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
-    c = ws.ws_col;
-  } else {
-    c = isatty(STDOUT_FILENO) ? 80 : 0;
+  curl_multi_remove_handle(multi, primary);
+  if (limiter != NULL) {
+    release_limiter(primary, token, winner == primary ? r : CURLE_OK, winner == primary, arg);
   }
 
-  cached_columns = c;
-  return cached_columns;
-}
+  if (hedge != NULL) {
+    curl_multi_remove_handle(multi, hedge);
 
-char *get_file_as_buffer(const char *path) {
-  _cleanup_fclose_ FILE *fp = NULL;
-  char *buf;
-  long fsize, nread;
+    if (limiter != NULL) {
+      release_limiter(hedge, hedgetoken, winner == hedge ? r : CURLE_OK, winner == hedge, arg);
+    }
 
-  fp = fopen(path, "r");
-  if (!fp) {
-    cwr_fprintf(stderr, LOG_ERROR, "error: failed to open %s: %s\n",
-        path, strerror(errno));
-    return NULL;
-  }
+    if (winner == hedge) {
+      struct buffer_t response = *task->response;
+      CURL *curl = task->curl;
 
-  fseek(fp, 0L, SEEK_END);
-  fsize = ftell(fp);
-  fseek(fp, 0L, SEEK_SET);
+      cwr_printf(LOG_DEBUG, "[%s]: hedged request finished first\n", arg);
+      *task->response = hedgebuf;
+      hedgebuf = response;
+      task->curl = hedge;
+      hedge = curl;
+      curl_easy_setopt(task->curl, CURLOPT_WRITEDATA, task);
+    }
 
-  buf = calloc(1, (size_t)fsize + 1);
+    curl_easy_cleanup(hedge);
+    free(hedgebuf.data);
+  }
 
-  nread = fread(buf, 1, fsize, fp);
+  curl_multi_cleanup(multi);
 
-  if (nread < fsize) {
-    cwr_fprintf(stderr, LOG_ERROR, "Failed to read full PKGBUILD\n");
+  return r;
+}
+
+/* One attempt at the transfer already set up on task->curl. */
+CURLcode task_perform(struct task_t *task, const char *arg) {
+  /* tarballs are large, and a stalled one is resumed rather than raced */
+  const curl_off_t threshold = cfg.hedge && !task->resumable ? latency_p95() : 0;
+  struct timespec started, finished;
+  uint64_t token = 0;
+  long remaining;
+  CURLcode r;
+
+  if (limiter != NULL) {
+    token = limiter_acquire(limiter);
+  }
+
+  /* every request gets whatever is left of the run's budget. they run side
+   * by side, so this bounds the run as a whole. */
+  remaining = deadline_remaining();
+  if (remaining == 0) {
+    if (limiter != NULL) {
+      limiter_release(limiter, token, LIMITER_IGNORE, 0);
+    }
+    return CURLE_OPERATION_TIMEDOUT;
+  } else if (remaining > 0) {
+    curl_easy_setopt(task->curl, CURLOPT_TIMEOUT_MS, remaining);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  if (threshold > 0) {
+    r = task_perform_hedged(task, threshold, token, arg);
+  } else {
+    r = curl_easy_perform(task->curl);
+    if (limiter != NULL) {
+      release_limiter(task->curl, token, r, 1, arg);
+    }
+  }
+
+  /* from when the request was first made, however many attempts at it were
+   * raced. a hedge's own time would make a slow server look fast. */
+  if (r == CURLE_OK && !task->resumable) {
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    latency_record((curl_off_t)(finished.tv_sec - started.tv_sec) * 1000000 +
+        (finished.tv_nsec - started.tv_nsec) / 1000);
+  }
+
+  return r;
+}
+
+int http_should_retry(CURLcode r, long response_code) {
+  switch (r) {
+    case CURLE_OK:
+      break;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+      return 1;
+    default:
+      return 0;
+  }
+
+  switch (response_code) {
+    case 429:
+    case 500:
+    case 502:
+    case 503:
+    case 504:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/* Exponential backoff with full jitter, unless the server asked for
+ * something else. Whatever it asked for is returned as is, since retrying
+ * any sooner would only get us turned away again. */
+long retry_delay(struct task_t *task, int attempt) {
+  curl_off_t retry_after = 0;
+  long cap = kRetryBaseDelay << (attempt < 5 ? attempt : 5);
+
+  if (cap > kRetryMaxDelay) {
+    cap = kRetryMaxDelay;
+  }
+
+  curl_easy_getinfo(task->curl, CURLINFO_RETRY_AFTER, &retry_after);
+  if (retry_after > 0) {
+    return retry_after > LONG_MAX / 1000 ? LONG_MAX : (long)retry_after * 1000;
+  }
+
+  return rand_r(&task->seed) % (cap + 1);
+}
+
+/* Milliseconds left until the deadline, or -1 if there isn't one. */
+long deadline_remaining(void) {
+  struct timespec now;
+  long ms;
+
+  if (cfg.deadline == 0) {
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ms = (deadline_at.tv_sec - now.tv_sec) * 1000 + (deadline_at.tv_nsec - now.tv_nsec) / 1000000;
+
+  return ms > 0 ? ms : 0;
+}
+
+void report_unresolved(const char *target) {
+  char *copy = strdup(target);
+
+  if (copy == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&unresolved.lock);
+  unresolved.targets = alpm_list_add(unresolved.targets, copy);
+  pthread_mutex_unlock(&unresolved.lock);
+}
+
+/* Wait for the request's turn in the budget, unless the deadline would pass
+ * first. Snapshots come from cgit, which the AUR doesn't count. */
+int task_spend_budget(struct task_t *task, const char *arg) {
+  struct timespec delay;
+  double left;
+  long ms, remaining;
+
+  if (budget == NULL || task->resumable) {
+    return 0;
+  }
+
+  ms = budget_take(budget, &left);
+  cwr_printf(LOG_DEBUG, "[%s]: request budget has %.1f requests left\n", arg, left);
+  if (ms == 0) {
+    return 0;
+  }
+
+  remaining = deadline_remaining();
+  if (remaining >= 0 && ms >= remaining) {
+    budget_refund(budget);
+    return -ETIMEDOUT;
+  }
+
+  cwr_printf(LOG_VERBOSE, "[%s]: request budget spent, waiting %ld ms\n", arg, ms);
+  delay.tv_sec = ms / 1000;
+  delay.tv_nsec = (ms % 1000) * 1000000;
+  while (nanosleep(&delay, &delay) < 0 && errno == EINTR);
+
+  return 0;
+}
+
+int task_http_execute(struct task_t *task, const char *url, const char *arg) {
+  const size_t start = task->response->size;
+  int attempt = 0, failovers = 0;
+
+  for (;;) {
+    _cleanup_free_ char *rebased = NULL;
+    struct timespec delay;
+    CURLcode r;
+    curl_off_t ttfb = 0;
+    long response_code = 0, ms, remaining;
+    int endpoint, failed, failover;
+
+    /* urls are built against the first endpoint */
+    endpoint = aur_endpoint_pick(task->aur);
+    if (endpoint > 0) {
+      rebased = aur_endpoint_url(task->aur, endpoint, url);
+      if (rebased == NULL) {
+        cwr_fprintf(stderr, LOG_ERROR, "[%s]: failed to allocate URL\n", arg);
+        return 1;
+      }
+    }
+    curl_easy_setopt(task->curl, CURLOPT_URL, rebased ? rebased : url);
+
+    if (task_spend_budget(task, arg) < 0) {
+      cwr_printf(LOG_VERBOSE, "[%s]: giving up, the deadline will pass before the budget allows this\n",
+          arg);
+      task->timed_out = 1;
+      return 1;
+    }
+
+    cwr_printf(LOG_DEBUG, "[%s]: curl_easy_perform %s\n", arg, rebased ? rebased : url);
+
+    r = task_perform(task, arg);
+    curl_easy_getinfo(task->curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+    /* a request cut short by the deadline says nothing about the endpoint */
+    failed = http_should_retry(r, response_code);
+    remaining = deadline_remaining();
+    if (remaining != 0) {
+      curl_easy_getinfo(task->curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+      aur_endpoint_report(task->aur, endpoint, !failed, ttfb);
+    }
+
+    if (r == CURLE_OK) {
+      cwr_printf(LOG_DEBUG, "[%s]: server responded with %ld\n", arg, response_code);
+
+      /* 206 and 304 only ever come back from ranged or conditional requests */
+      if (response_code == 200 || response_code == 206 || response_code == 304) {
+        return 0;
+      }
+    }
+
+    /* a download which got somewhere is better off resumed by the caller
+     * than restarted here */
+    if (task->resumable && task->response->size > start) {
+      failed = 0;
+    }
+    failover = failed && failovers < task->aur->nendpoints - 1;
+
+    /* out of time, or out of time to wait before trying again. these are
+     * reported all together at the end of the run. */
+    ms = retry_delay(task, attempt);
+    if (remaining == 0 || (remaining > 0 && ms >= remaining && !failover &&
+          attempt < cfg.retries && failed)) {
+      cwr_printf(LOG_VERBOSE, "[%s]: giving up, the deadline has passed\n", arg);
+      task->timed_out = 1;
+      return 1;
+    }
+
+    if (failover) {
+      /* the endpoint is now out of the running for a while, so the next
+       * pick lands elsewhere. there's no reason to wait for that. */
+      failovers++;
+      cwr_printf(LOG_VERBOSE, "[%s]: %s failed, trying another endpoint\n", arg,
+          task->aur->endpoints[endpoint].urlprefix);
+    } else {
+      if (attempt >= cfg.retries || !failed) {
+        if (r != CURLE_OK) {
+          cwr_fprintf(stderr, LOG_ERROR, "[%s]: %s\n", arg, curl_easy_strerror(r));
+        } else {
+          cwr_fprintf(stderr, LOG_ERROR, "[%s]: server responded with HTTP %ld\n",
+              arg, response_code);
+        }
+        return 1;
+      }
+
+      /* the deadline bounds the wait above. without one, don't wait on a
+       * server indefinitely, but don't retry before it said to either. */
+      if (remaining < 0 && ms > kRetryAfterMax) {
+        cwr_fprintf(stderr, LOG_ERROR, "[%s]: server responded with HTTP %ld, and asked to wait "
+            "%ld s before retrying\n", arg, response_code, ms / 1000);
+        return 1;
+      }
+
+      if (r != CURLE_OK) {
+        cwr_printf(LOG_VERBOSE, "[%s]: %s, retrying in %ld ms\n", arg, curl_easy_strerror(r), ms);
+      } else {
+        cwr_printf(LOG_VERBOSE, "[%s]: server responded with HTTP %ld, retrying in %ld ms\n",
+            arg, response_code, ms);
+      }
+
+      delay.tv_sec = ms / 1000;
+      delay.tv_nsec = (ms % 1000) * 1000000;
+      while (nanosleep(&delay, &delay) < 0 && errno == EINTR);
+      attempt++;
+    }
+
+    /* whatever arrived was the start of a body we're about to get again */
+    task->response->size = start;
+    task->response_sized = 0;
+    if (task->response->data != NULL) {
+      task->response->data[start] = '\0';
+    }
+  }
+}
+
+aurpkg_t **download(struct task_t *task, const char *package) {
+  aurpkg_t **result;
+
+  result = rpc_info(task, package);
+  if (!result) {
+    cwr_fprintf(stderr, LOG_ERROR, "no results found for %s\n", package);
+    return NULL;
+  }
+
+  /* reported once it has been extracted */
+  download_package(task, result[0], 1);
+  aur_packages_free(result);
+
+  return NULL;
+}
+
+/* A strong ETag is needed to safely stitch a resumed transfer together. */
+int etag_is_strong(const char *etag) {
+  return etag != NULL && strncmp(etag, "W/", 2) != 0;
+}
+
+/* Fetch a snapshot from the AUR into response. If the snapshot hasn't changed
+ * since the marker was written, the server answers 304 and response stays
+ * empty. A transfer which breaks partway through is resumed from where it
+ * stopped, and if it can't be completed, what was received is kept in the
+ * store for a later run to pick up. */
+int fetch_snapshot(struct task_t *task, const aurpkg_t *package, const struct marker_t *marker,
+    struct buffer_t *response, char **etag, long *response_code) {
+  _cleanup_free_ char *url = NULL;
+  int attempt, resumed = 0, ret = -EIO;
+
+  url = aur_build_url(task->aur, package->aur_urlpath);
+  if (url == NULL) {
+    return -ENOMEM;
+  }
+
+  if (store != NULL && store_partial_get(store, package->pkgbase, package->modified_s,
+        etag, &response->data, &response->size) == 0) {
+    response->capacity = response->size + 1;
+    resumed = 1;
+  }
+
+  for (attempt = 0; attempt <= kMaxResumeAttempts; attempt++) {
+    struct curl_slist *headers = NULL;
+    const size_t offset = response->size;
+    _cleanup_free_ char *condition = NULL;
+    int r;
+
+    task_reset_for_download(task, url, response);
+    curl_easy_setopt(task->curl, CURLOPT_HEADERFUNCTION, curl_header_etag);
+    curl_easy_setopt(task->curl, CURLOPT_HEADERDATA, etag);
+
+    if (offset > 0) {
+      /* If-Range makes the server send the whole thing should the tarball
+       * have changed since the bytes we hold were sent */
+      cwr_printf(LOG_VERBOSE, "resuming download of %s at %zu bytes\n", package->name, offset);
+      curl_easy_setopt(task->curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)offset);
+      if (asprintf(&condition, "If-Range: %s", *etag) < 0) {
+        condition = NULL;
+      }
+    } else if (marker->etag != NULL) {
+      /* the package metadata changed, but the snapshot itself might not have */
+      if (asprintf(&condition, "If-None-Match: %s", marker->etag) < 0) {
+        condition = NULL;
+      }
+    }
+
+    if (condition != NULL) {
+      headers = curl_slist_append(NULL, condition);
+      curl_easy_setopt(task->curl, CURLOPT_HTTPHEADER, headers);
+    }
+
+    r = task_http_execute(task, url, package->name);
+    curl_easy_getinfo(task->curl, CURLINFO_RESPONSE_CODE, response_code);
+    curl_slist_free_all(headers);
+
+    if (r == 0) {
+      ret = 0;
+      break;
+    }
+
+    /* a 200 means the tarball changed since the bytes we hold were sent, and
+     * curl refuses to treat that as a continuation. a 416 means what we hold
+     * doesn't line up with anything. either way, start over. */
+    if (offset > 0 && (*response_code == 200 || *response_code == 416)) {
+      response->size = 0;
+      continue;
+    }
+
+    /* only keep going while the body is arriving and getting somewhere */
+    if ((*response_code != 200 && *response_code != 206) ||
+        response->size == offset || !etag_is_strong(*etag)) {
+      break;
+    }
+  }
+
+  if (store != NULL) {
+    if (ret == 0) {
+      if (resumed || attempt > 0) {
+        store_partial_drop(store, package->pkgbase, package->modified_s);
+      }
+    } else if ((*response_code == 200 || *response_code == 206) &&
+        response->size > 0 && etag_is_strong(*etag)) {
+      cwr_printf(LOG_VERBOSE, "keeping %zu bytes of %s to resume later\n",
+          response->size, package->name);
+      store_partial_put(store, package->pkgbase, package->modified_s,
+          *etag, response->data, response->size);
+    }
+  }
+
+  return ret;
+}
+
+/* Everything that happens once a package's snapshot is in place. */
+void finish_download(const aurpkg_t *package, int report) {
+  if (store != NULL) {
+    remember_package(package);
+  }
+
+  if (report) {
+    aurpkg_t *copy = aur_package_dup(package);
+    aurpkg_t **single = copy ? package_list_new(copy) : NULL;
+
+    pthread_mutex_lock(&downloaded.lock);
+    if (single == NULL || aur_packages_append(&downloaded.packages, single) < 0) {
+      aur_package_free(copy);
+      free(single);
+    }
+    pthread_mutex_unlock(&downloaded.lock);
+  }
+
+  if (cfg.getdeps && resolve_srcinfo_dependencies((aurpkg_t *)package) != 0) {
+    resolve_pkg_dependencies((aurpkg_t *)package);
+  }
+}
+
+/* Fetch the snapshot for an already resolved package, and hand it to the
+ * extraction stage, so that this network worker can move straight on to the
+ * next fetch. If report is set, the package is added to the results once it
+ * has been extracted. */
+int download_package(struct task_t *task, aurpkg_t *package, int report) {
+  struct extract_job_t *job;
+  long response_code = 0;
+  int ret;
+
+  cwr_printf(LOG_DEBUG, "package %s is part of pkgbase %s\n", package->name, package->pkgbase);
+
+  if (!snapshot_claim(package->pkgbase, &ret)) {
+    /* another package from the same pkgbase got there first */
+    if (ret != 0) {
+      return ret;
+    }
+
+    cwr_printf(LOG_DEBUG, "[%s]: pkgbase %s already fetched\n", package->name, package->pkgbase);
+    cwr_printf(LOG_INFO, "%s%s%s downloaded to %s\n",
+        colstr.pkg, package->name, colstr.nc, cfg.working_dir);
+    finish_download(package, report);
+    return 0;
+  }
+
+  job = calloc(1, sizeof(*job));
+  if (job == NULL) {
+    snapshot_release(package->pkgbase, -ENOMEM);
+    return -ENOMEM;
+  }
+
+  if (marker_read(package->pkgbase, &job->marker) == 0 && marker_matches(&job->marker, package)) {
+    cwr_printf(LOG_INFO, "%s%s%s is up to date in %s\n",
+        colstr.pkg, package->name, colstr.nc, cfg.working_dir);
+    ret = 0;
+    goto finish;
+  }
+
+  if (access(package->pkgbase, F_OK) == 0 && !cfg.force) {
+    cwr_fprintf(stderr, LOG_ERROR, "`%s/%s' already exists. Use -f to overwrite.\n",
+        cfg.working_dir, package->pkgbase);
+    ret = -EEXIST;
+    goto finish;
+  }
+
+  if (store != NULL && store_get(store, package->pkgbase, package->modified_s,
+        &job->response.data, &job->response.size) == 0) {
+    cwr_printf(LOG_DEBUG, "[%s]: using stored snapshot of %s\n", package->name, package->pkgbase);
+  } else if (cfg.offline) {
+    cwr_fprintf(stderr, LOG_ERROR, "[%s]: no stored snapshot of %s is available offline\n",
+        package->name, package->pkgbase);
+    ret = -ENOENT;
+    goto finish;
+  } else {
+    ret = fetch_snapshot(task, package, &job->marker, &job->response, &job->etag, &response_code);
+    if (ret < 0) {
+      goto finish;
+    }
+
+    job->unchanged = response_code == 304;
+    if (store != NULL && !job->unchanged) {
+      int r = store_put(store, package->pkgbase, package->modified_s,
+          job->response.data, job->response.size);
+      if (r < 0) {
+        cwr_fprintf(stderr, LOG_WARN, "[%s]: failed to store snapshot: %s\n",
+            package->name, strerror(-r));
+      }
+    }
+  }
+
+  job->package = aur_package_dup(package);
+  job->report = report;
+  if (job->package == NULL || queue_extract(job) < 0) {
+    ret = -ENOMEM;
+    goto finish;
+  }
+
+  return 0;
+
+finish:
+  snapshot_release(package->pkgbase, ret);
+  if (ret == 0) {
+    finish_download(package, report);
+  }
+
+  extract_job_free(job);
+
+  return ret;
+}
+
+void extract_job_free(struct extract_job_t *job) {
+  aur_package_free(job->package);
+  free(job->response.data);
+  free(job->etag);
+  marker_clear(&job->marker);
+  free(job);
+}
+
+/* Batch file creation where the kernel lets us. Returns NULL, leaving it all
+ * to libarchive, if it doesn't or if asked not to. */
+diskq_t *extract_diskq_new(void) {
+  static int warned;
+  diskq_t *q = NULL;
+  int r;
+
+  if (cfg.sync_extract) {
+    return NULL;
+  }
+
+  r = diskq_new(&q);
+  if (r < 0 && !__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+    cwr_printf(LOG_DEBUG, "not batching file writes: %s\n", strerror(-r));
+  }
+
+  return q;
+}
+
+/* The extraction stage: everything which touches the pkgbase directory. */
+void extract_snapshot(struct extract_job_t *job, diskq_t *q) {
+  aurpkg_t *package = job->package;
+  alpm_list_t *files = NULL;
+  int ret = 0;
+
+  if (job->unchanged) {
+    cwr_printf(LOG_DEBUG, "[%s]: snapshot unchanged since last download\n", package->name);
+    files = job->marker.files;
+    job->marker.files = NULL;
+  } else {
+    ret = archive_extract_file(job->response.data, job->response.size, q, &files);
+    if (ret != 0) {
+      cwr_fprintf(stderr, LOG_ERROR, "[%s]: failed to extract tarball: %s\n",
+          package->name, strerror(ret));
+      ret = -ret;
+      goto finish;
+    }
+
+    remove_stale_files(job->marker.files, files);
+  }
+
+  update_marker(package, job->etag ? job->etag : job->marker.etag, files);
+
+finish:
+  FREELIST(files);
+  snapshot_release(package->pkgbase, ret);
+
+  if (ret == 0) {
+    cwr_printf(LOG_INFO, "%s%s%s %s %s\n", colstr.pkg, package->name, colstr.nc,
+        job->unchanged ? "is up to date in" : "downloaded to", cfg.working_dir);
+    finish_download(package, job->report);
+  }
+}
+
+/* TODO: rewrite comparators to avoid this duplication */
+static int aurpkgp_cmpname(const void *a, const void *b) {
+  const aurpkg_t *const *p1 = a;
+  const aurpkg_t *const *p2 = b;
+
+  return aurpkg_cmpname(*p1, *p2);
+}
+
+aurpkg_t **dedupe_results(aurpkg_t **packages) {
+  aurpkg_t *prev = NULL;
+  int i, len;
+
+  if (packages == NULL) {
+    return NULL;
+  }
+
+  len = aur_packages_count(packages);
+
+  qsort(packages, len, sizeof(*packages), aurpkgp_cmpname);
+
+  for (i = 0; i < len; i++) {
+    if (prev == NULL || aurpkg_cmpname(packages[i], prev) != 0) {
+      prev = packages[i];
+    } else {
+      packages[i]->ignored = 1;
+    }
+  }
+
+  return packages;
+}
+
+int should_ignore_package(const aurpkg_t *package, regex_t *pattern) {
+  if ((cfg.search_by == SEARCHBY_NAME || cfg.search_by == SEARCHBY_NAME_DESC) &&
+      regexec(pattern, package->name, 0, 0, 0) != REG_NOMATCH) {
+    return 0;
+  }
+
+  if (cfg.search_by == SEARCHBY_NAME_DESC && package->description &&
+      regexec(pattern, package->description, 0, 0, 0) != REG_NOMATCH) {
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Returns 1 if the caller now owns fetching pkgbase and must report back with
+ * snapshot_release. Otherwise, waits for whoever does own it to finish and
+ * returns 0 with their result. */
+int snapshot_claim(const char *pkgbase, int *result) {
+  void *value;
+
+  *result = 0;
+
+  /* without a registry, or if the claim can't be recorded, just fetch it
+   * unshared */
+  if (snapshots == NULL || flight_get(snapshots, pkgbase, 1, &value) == FLIGHT_MISS) {
+    return 1;
+  }
+
+  *result = (int)(intptr_t)value;
+
+  return 0;
+}
+
+void snapshot_release(const char *pkgbase, int result) {
+  if (snapshots != NULL) {
+    flight_put(snapshots, pkgbase, (void *)(intptr_t)result);
+  }
+}
+
+/* Queue targets read from stdin while the workers are already running. With
+ * -u and no other targets, nothing at all on stdin means every foreign
+ * package, as it would have without the '-'. */
+int feed_targets_from_stdin(void) {
+  int r;
+
+  cwr_printf(LOG_DEBUG, "reading targets from stdin\n");
+  r = read_targets_from_file(STDIN_FILENO);
+
+  if (!freopen(ctermid(NULL), "r", stdin)) {
+    cwr_printf(LOG_DEBUG, "failed to reopen stdin for reading\n");
+  }
+
+  if (r == 0 && cfg.targets == NULL && (cfg.opmask & OP_UPDATE)) {
+    const alpm_list_t *i;
+
+    cfg.targets = alpm_find_foreign_pkgs();
+    for (i = cfg.targets; i; i = i->next) {
+      schedule_target(i->data, strlen(i->data));
+    }
+  }
+
+  return r < 0 ? r : 0;
+}
+
+/* Parse the files named by cfg.targets on a few threads, handing each
+ * dependency to the workers as soon as the file it came from is parsed. */
+int feed_targets_from_files(void) {
+  struct file_loader_t loader = { PTHREAD_MUTEX_INITIALIZER, cfg.targets };
+  _cleanup_free_ pthread_t *threads = NULL;
+  int i, num_threads, spawned = 0;
+  long nproc;
+
+  num_threads = alpm_list_count(cfg.targets);
+  nproc = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nproc > 0 && num_threads > nproc) {
+    num_threads = nproc;
+  }
+
+  threads = malloc(num_threads * sizeof(*threads));
+  if (threads == NULL) {
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < num_threads; i++) {
+    int r;
+
+    r = pthread_create(&threads[spawned], NULL, file_loader, &loader);
+    if (r != 0) {
+      cwr_fprintf(stderr, LOG_ERROR, "failed to spawn new thread: %s\n",
+          strerror(r));
+      break;
+    }
+    spawned++;
+  }
+
+  /* if we couldn't get any help, do the work ourselves */
+  if (spawned == 0) {
+    file_loader(&loader);
+  }
+
+  for (i = 0; i < spawned; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  return 0;
+}
+
+void *file_loader(void *arg) {
+  struct file_loader_t *loader = arg;
+
+  for (;;) {
+    alpm_list_t *deps = NULL, *i;
+    const char *path = NULL;
+
+    pthread_mutex_lock(&loader->lock);
+    if (loader->next) {
+      path = loader->next->data;
+      loader->next = loader->next->next;
+    }
+    pthread_mutex_unlock(&loader->lock);
+
+    if (path == NULL) {
+      break;
+    }
+
+    load_depends_from_file(path, &deps);
+    for (i = deps; i; i = i->next) {
+      schedule_target(i->data, strcspn(i->data, "<>="));
+    }
+    FREELIST(deps);
+  }
+
+  return NULL;
+}
+
+/* Wrap a single package in a NULL terminated list. */
+aurpkg_t **package_list_new(aurpkg_t *package) {
+  aurpkg_t **list;
+
+  list = calloc(2, sizeof(*list));
+  if (list == NULL) {
+    return NULL;
+  }
+
+  list[0] = package;
+  return list;
+}
+
+aurpkg_t **filter_results(aurpkg_t **packages) {
+  if (packages == NULL) {
+    return NULL;
+  }
+
+  dedupe_results(packages);
+
+  /* with --from-pkgbuild, the targets are filenames rather than patterns */
+  if (allow_regex() && !cfg.frompkgbuild) {
+    const alpm_list_t *i;
+
+    for (i = cfg.targets; i; i = i->next) {
+      regex_t regex;
+      aurpkg_t **p;
+
+      /* this should succeed since we validated the regex up front */
+      regcomp(&regex, i->data, kRegexOpts);
+
+      for (p = packages; *p; p++) {
+        aurpkg_t *pkg = *p;
+
+        if (pkg->ignored || (pkg->ignored = should_ignore_package(pkg, &regex))) {
+          continue;
+        }
+      }
+      regfree(&regex);
+    }
+  }
+
+  return packages;
+}
+
+int getcols(void) {
+  int c;
+  struct winsize ws;
+  static int cached_columns = -1;
+
+  if (cached_columns >= 0) {
+    return cached_columns;
+  }
+
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+    c = ws.ws_col;
+  } else {
+    c = isatty(STDOUT_FILENO) ? 80 : 0;
+  }
+
+  cached_columns = c;
+  return cached_columns;
+}
+
+char *get_file_as_buffer(const char *path) {
+  _cleanup_fclose_ FILE *fp = NULL;
+  char *buf;
+  long fsize, nread;
+
+  fp = fopen(path, "r");
+  if (!fp) {
+    cwr_fprintf(stderr, LOG_ERROR, "error: failed to open %s: %s\n",
+        path, strerror(errno));
+    return NULL;
+  }
+
+  fseek(fp, 0L, SEEK_END);
+  fsize = ftell(fp);
+  fseek(fp, 0L, SEEK_SET);
+
+  buf = calloc(1, (size_t)fsize + 1);
+
+  nread = fread(buf, 1, fsize, fp);
+
+  if (nread < fsize) {
+    cwr_fprintf(stderr, LOG_ERROR, "Failed to read full PKGBUILD\n");
     free(buf);
     return NULL;
   }
@@ -861,10 +2242,107 @@ int get_config_path(char *config_path, size_t pathlen) {
   return 1;
 }
 
+int get_cache_path(char *cache_path, size_t pathlen) {
+  char *var;
+  struct passwd *pwd;
+
+  var = getenv("XDG_CACHE_HOME");
+  if (var != NULL) {
+    snprintf(cache_path, pathlen, "%s/cower", var);
+    return 0;
+  }
+
+  var = getenv("HOME");
+  if (var != NULL) {
+    snprintf(cache_path, pathlen, "%s/.cache/cower", var);
+    return 0;
+  }
+
+  pwd = getpwuid(getuid());
+  if (pwd != NULL && pwd->pw_dir != NULL) {
+    snprintf(cache_path, pathlen, "%s/.cache/cower", pwd->pw_dir);
+    return 0;
+  }
+
+  return 1;
+}
+
+/* How many bytes at the start of s are printable ASCII other than a space,
+ * checked a word at a time. */
+static size_t ascii_span(const char *s, size_t len) {
+  const unsigned long ones = ~0UL / 255, highs = ones * 0x80;
+  size_t i;
+
+  /* a byte below '!' borrows into its top bit, and anything not ASCII has
+   * it set already */
+  for (i = 0; i + sizeof(unsigned long) <= len; i += sizeof(unsigned long)) {
+    unsigned long w;
+
+    memcpy(&w, s + i, sizeof(w));
+    if (((w - ones * '!') | w) & highs) {
+      break;
+    }
+  }
+
+  for (; i < len; i++) {
+    const unsigned char c = s[i];
+    if (c <= ' ' || c >= 0x80) {
+      break;
+    }
+  }
+
+  return i;
+}
+
+/* The number of columns taken by s up to the next space or end, with the
+ * number of bytes that is in *len. */
+static int text_width(const char *s, const char *end, size_t *len) {
+  const char *p = s;
+  int width = 0;
+
+  while (p < end) {
+    mbstate_t state = { 0 };
+    wchar_t wc;
+    size_t n;
+    int w;
+
+    n = ascii_span(p, end - p);
+    p += n;
+    width += n;
+
+    if (p == end || *p == ' ') {
+      break;
+    }
+
+    if ((unsigned char)*p < 0x80) {
+      /* a control character, which takes up no room */
+      p++;
+      continue;
+    }
+
+    n = mbrtowc(&wc, p, end - p, &state);
+    if (n == (size_t)-1 || n == (size_t)-2) {
+      /* not valid here, but it's going out as is all the same */
+      p++;
+      width++;
+      continue;
+    }
+
+    w = wcwidth(wc);
+    if (w > 0) {
+      width += w;
+    }
+    p += n;
+  }
+
+  *len = p - s;
+  return width;
+}
+
 void indentprint(const char *str, int indent) {
-  wchar_t *wcstr;
-  const wchar_t *p;
-  int len, cidx, cols;
+  const char *p, *end;
+  size_t len;
+  int width, cidx, cols;
 
   if (!str) {
     return;
@@ -874,82 +2352,124 @@ void indentprint(const char *str, int indent) {
 
   /* if we're not a tty, print without indenting */
   if (cols == 0) {
-    fputs(str, stdout);
+    output_puts(output, str);
     return;
   }
 
-  len = strlen(str) + 1;
-  wcstr = calloc(len, sizeof(wchar_t));
-  len = mbstowcs(wcstr, str, len);
-  p = wcstr;
+  end = str + strlen(str);
   cidx = indent;
 
-  if (!p || !len) {
-    return;
-  }
-
-  while (*p) {
-    if (*p == L' ') {
-      const wchar_t *q, *next;
-      p++;
-      if (!p || *p == L' ') {
+  p = str;
+  while (p < end) {
+    if (*p == ' ') {
+      /* of several spaces in a row, only the last is kept */
+      if (*++p == ' ') {
         continue;
       }
-      next = wcschr(p, L' ');
-      if (!next) {
-        next = p + wcslen(p);
-      }
 
-      /* len captures # cols */
-      len = 0;
-      q = p;
-
-      while (q < next) {
-        len += wcwidth(*q++);
-      }
-
-      if (len > (cols - cidx - 1)) {
+      width = text_width(p, end, &len);
+      if (width > (cols - cidx - 1)) {
         /* wrap to a newline and reindent */
-        printf("\n%-*s", indent, "");
+        output_putc(output, '\n');
+        output_pad(output, indent);
         cidx = indent;
       } else {
-        fputc(' ', stdout);
+        output_putc(output, ' ');
         cidx++;
       }
-      continue;
+    } else {
+      width = text_width(p, end, &len);
     }
-#ifdef __clang__
-    printf("%lc", *p);
-#else /* assume GCC */
-    printf("%lc", (wint_t)*p);
-#endif
-    cidx += wcwidth(*p);
-    p++;
+
+    output_write(output, p, len);
+    cidx += width;
+    p += len;
+  }
+}
+
+int load_depends_from_file(const char *path, alpm_list_t **deplist) {
+  _cleanup_free_ char *srcinfo = srcinfo_path_for(path);
+  struct mapped_file_t file;
+  int r;
+
+  if (srcinfo != NULL && srcinfo_load_depends(srcinfo, NULL, deplist) == 0) {
+    return 0;
+  }
+
+  /* no usable .SRCINFO, fall back to scraping the PKGBUILD */
+  r = map_file(path, &file);
+  if (r < 0) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to open %s: %s\n", path, strerror(-r));
+    return r;
   }
-  free(wcstr);
+
+  /* The scraper wants a NUL terminated buffer. The tail of the last page of
+   * a mapping is zero filled, so we get one for free unless the file ends
+   * exactly on a page boundary. */
+  if (file.size % sysconf(_SC_PAGESIZE) != 0) {
+    pkgbuild_get_depends(file.data, deplist);
+  } else {
+    _cleanup_free_ char *pkgbuild = get_file_as_buffer(path);
+    pkgbuild_get_depends(pkgbuild, deplist);
+  }
+
+  unmap_file(&file);
+
+  return 0;
+}
+
+static struct utsname machine_uname;
+
+static void machine_uname_init(void) {
+  if (uname(&machine_uname) != 0) {
+    machine_uname.machine[0] = '\0';
+  }
+}
+
+const char *machine_arch(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+  pthread_once(&once, machine_uname_init);
+
+  return machine_uname.machine[0] ? machine_uname.machine : NULL;
+}
+
+int marker_matches(const struct marker_t *marker, const aurpkg_t *package) {
+  return marker->lastmodified == package->modified_s &&
+      streq(marker->version, package->version);
 }
 
-alpm_list_t *load_targets_from_files(alpm_list_t *files) {
-  alpm_list_t *i, *targets = NULL, *results = NULL;
+int map_file(const char *path, struct mapped_file_t *file) {
+  struct stat st;
+  int fd, r = 0;
 
-  for (i = files; i; i = i->next) {
-    _cleanup_free_ char *pkgbuild = get_file_as_buffer(i->data);
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
 
-    /* TODO: parse .SRCINFO instead of PKGBUILD */
-    pkgbuild_get_depends(pkgbuild, &results);
+  if (fstat(fd, &st) < 0) {
+    r = -errno;
+    goto finish;
   }
 
-  /* sanitize and dedupe */
-  for (i = results; i; i = i->next) {
-    char *sanitized = strdup(i->data);
+  file->data = NULL;
+  file->size = st.st_size;
+  if (file->size == 0) {
+    goto finish;
+  }
 
-    sanitized[strcspn(sanitized, "<>=")] = '\0';
-    if (!alpm_list_find_str(targets, sanitized)) {
-      targets = alpm_list_add(targets, sanitized);
-    }
+  /* writable, but private, so that callers may tokenize in place */
+  file->data = mmap(NULL, file->size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (file->data == MAP_FAILED) {
+    file->data = NULL;
+    r = -errno;
   }
 
-  return targets;
+finish:
+  close(fd);
+
+  return r;
 }
 
 alpm_list_t *parse_bash_array(alpm_list_t *deplist, char *array) {
@@ -1031,7 +2551,11 @@ int parse_configfile(void) {
 
     /* colors are not initialized in this section, so usage of cwr_printf
      * functions is verboten unless we're using loglevel_t LOG_DEBUG */
-    if (streq(key, "IgnoreRepo")) {
+    if (streq(key, "Domain")) {
+      for (key = strtok(val, " "); key; key = strtok(NULL, " ")) {
+        cfg.domains = alpm_list_add(cfg.domains, strdup(key));
+      }
+    } else if (streq(key, "IgnoreRepo")) {
       for (key = strtok(val, " "); key; key = strtok(NULL, " ")) {
         cwr_printf(LOG_DEBUG, "ignoring repo: %s\n", key);
         cfg.ignore.repos = alpm_list_add(cfg.ignore.repos, strdup(key));
@@ -1043,6 +2567,10 @@ int parse_configfile(void) {
       }
     } else if (streq(key, "IgnoreOOD")) {
       cfg.ignoreood = 1;
+    } else if (streq(key, "Hedge")) {
+      cfg.hedge |= 1;
+    } else if (streq(key, "SyncExtract")) {
+      cfg.sync_extract |= 1;
     } else if (streq(key, "TargetDir")) {
       if (val) {
         wordexp_t p;
@@ -1061,6 +2589,112 @@ int parse_configfile(void) {
           r = 1;
         }
       }
+    } else if (streq(key, "CacheDir")) {
+      if (val) {
+        wordexp_t p;
+        if (wordexp(val, &p, 0) == 0) {
+          if (p.we_wordc == 1) {
+            free(cfg.cache_dir);
+            cfg.cache_dir = strdup(p.we_wordv[0]);
+          }
+          wordfree(&p);
+          /* error on relative paths */
+          if (cfg.cache_dir && *cfg.cache_dir != '/') {
+            fprintf(stderr, "error: CacheDir cannot be a relative path\n");
+            r = 1;
+          }
+        } else {
+          fprintf(stderr, "error: failed to resolve option to CacheDir\n");
+          r = 1;
+        }
+      }
+    } else if (streq(key, "BudgetFile")) {
+      if (val) {
+        wordexp_t p;
+        if (wordexp(val, &p, 0) == 0) {
+          if (p.we_wordc == 1) {
+            free(cfg.budget_file);
+            cfg.budget_file = strdup(p.we_wordv[0]);
+          }
+          wordfree(&p);
+          if (cfg.budget_file && *cfg.budget_file != '/') {
+            fprintf(stderr, "error: BudgetFile cannot be a relative path\n");
+            r = 1;
+          }
+        } else {
+          fprintf(stderr, "error: failed to resolve option to BudgetFile\n");
+          r = 1;
+        }
+      }
+    } else if (streq(key, "RequestBudget")) {
+      if (val) {
+        cfg.request_budget = strtol(val, &key, 10);
+        if (*key != '\0' || cfg.request_budget < 0) {
+          fprintf(stderr, "error: invalid option to RequestBudget: %s\n", val);
+          r = 1;
+        }
+      }
+    } else if (streq(key, "BufferHighWater")) {
+      if (val) {
+        cfg.buffer_highwater = strtol(val, &key, 10);
+        if (*key != '\0' || cfg.buffer_highwater < 0) {
+          fprintf(stderr, "error: invalid option to BufferHighWater: %s\n", val);
+          r = 1;
+        }
+      }
+    } else if (streq(key, "CacheSize")) {
+      if (val) {
+        cfg.cache_size = strtol(val, &key, 10);
+        if (*key != '\0' || cfg.cache_size < 0) {
+          fprintf(stderr, "error: invalid option to CacheSize: %s\n", val);
+          r = 1;
+        }
+      }
+    } else if (streq(key, "ExtractJobs")) {
+      if (val) {
+        cfg.extract_jobs = strtol(val, &key, 10);
+        if (*key != '\0' || cfg.extract_jobs <= 0) {
+          fprintf(stderr, "error: invalid option to ExtractJobs: %s\n", val);
+          r = 1;
+        }
+      }
+    } else if (streq(key, "Retries")) {
+      if (val) {
+        cfg.retries = strtol(val, &key, 10);
+        if (*key != '\0' || cfg.retries < 0) {
+          fprintf(stderr, "error: invalid option to Retries: %s\n", val);
+          r = 1;
+        }
+      }
+    } else if (streq(key, "Deadline")) {
+      if (val) {
+        cfg.deadline = strtol(val, &key, 10);
+        if (*key != '\0' || cfg.deadline < 0) {
+          fprintf(stderr, "error: invalid option to Deadline: %s\n", val);
+          r = 1;
+        }
+      }
+    } else if (streq(key, "LowSpeedLimit")) {
+      if (val) {
+        cfg.lowspeed_limit = strtol(val, &key, 10);
+        if (*key != '\0' || cfg.lowspeed_limit < 0) {
+          fprintf(stderr, "error: invalid option to LowSpeedLimit: %s\n", val);
+          r = 1;
+        }
+      }
+    } else if (streq(key, "LowSpeedTime")) {
+      if (val) {
+        cfg.lowspeed_time = strtol(val, &key, 10);
+        if (*key != '\0' || cfg.lowspeed_time < 0) {
+          fprintf(stderr, "error: invalid option to LowSpeedTime: %s\n", val);
+          r = 1;
+        }
+      }
+    } else if (streq(key, "MaxRate")) {
+      if (val && parse_rate(val, &cfg.max_rate) != 0) {
+        fprintf(stderr, "error: invalid option to MaxRate: %s\n", val);
+        r = 1;
+      }
     } else if (streq(key, "MaxThreads")) {
       if (val) {
         cfg.maxthreads = strtol(val, &key, 10);
@@ -1097,7 +2731,7 @@ int parse_configfile(void) {
 }
 
 int parse_options(int argc, char *argv[]) {
-  int opt, option_index = 0;
+  int opt, option_index = 0, domains_given = 0;
 
   static const struct option opts[] = {
     /* operations */
@@ -1109,11 +2743,15 @@ int parse_options(int argc, char *argv[]) {
 
     /* options */
     {"by",            required_argument,  0, OP_SEARCHBY},
+    {"cachedir",      required_argument,  0, OP_CACHEDIR},
     {"color",         optional_argument,  0, 'c'},
+    {"deadline",      required_argument,  0, OP_DEADLINE},
     {"debug",         no_argument,        0, OP_DEBUG},
     {"domain",        required_argument,  0, OP_AURDOMAIN},
+    {"extract-jobs",  required_argument,  0, OP_EXTRACTJOBS},
     {"force",         no_argument,        0, 'f'},
     {"format",        required_argument,  0, OP_FORMAT},
+    {"hedge",         no_argument,        0, OP_HEDGE},
     {"sort",          required_argument,  0, OP_SORT},
     {"rsort",         required_argument,  0, OP_RSORT},
     {"from-pkgbuild", no_argument,        0, 'p'},
@@ -1122,8 +2760,13 @@ int parse_options(int argc, char *argv[]) {
     {"ignore-ood",    no_argument,        0, 'o'},
     {"no-ignore-ood", no_argument,        0, OP_NOIGNOREOOD},
     {"ignorerepo",    optional_argument,  0, OP_IGNOREREPO},
+    {"json",          no_argument,        0, OP_JSON},
     {"listdelim",     required_argument,  0, OP_LISTDELIM},
+    {"max-rate",      required_argument,  0, OP_MAXRATE},
+    {"ndjson",        no_argument,        0, OP_NDJSON},
+    {"offline",       no_argument,        0, OP_OFFLINE},
     {"quiet",         no_argument,        0, 'q'},
+    {"retries",       required_argument,  0, OP_RETRIES},
     {"target",        required_argument,  0, 't'},
     {"threads",       required_argument,  0, OP_THREADS},
     {"timeout",       required_argument,  0, OP_TIMEOUT},
@@ -1199,6 +2842,12 @@ int parse_options(int argc, char *argv[]) {
       case OP_FORMAT:
         cfg.format = optarg;
         break;
+      case OP_JSON:
+        cfg.json = JSON_ARRAY;
+        break;
+      case OP_NDJSON:
+        cfg.json = JSON_LINES;
+        break;
       case OP_RSORT:
         cfg.sortorder = SORT_REVERSE;
         FALLTHROUGH;
@@ -1207,6 +2856,7 @@ int parse_options(int argc, char *argv[]) {
           fprintf(stderr, "error: invalid argument to --%s\n", opts[option_index].name);
           return 1;
         }
+        cfg.sorted |= 1;
         break;
       case 'o':
         cfg.ignoreood = 1;
@@ -1234,7 +2884,12 @@ int parse_options(int argc, char *argv[]) {
         cfg.ignoreood = 0;
         break;
       case OP_AURDOMAIN:
-        cfg.aur_domain = optarg;
+        /* the command line replaces, rather than adds to, the config */
+        if (!domains_given) {
+          FREELIST(cfg.domains);
+          domains_given = 1;
+        }
+        cfg.domains = alpm_list_add(cfg.domains, strdup(optarg));
         break;
       case OP_LISTDELIM:
         cfg.delim = optarg;
@@ -1246,6 +2901,36 @@ int parse_options(int argc, char *argv[]) {
           return 1;
         }
         break;
+      case OP_EXTRACTJOBS:
+        cfg.extract_jobs = strtol(optarg, &token, 10);
+        if (*token != '\0' || cfg.extract_jobs <= 0) {
+          fprintf(stderr, "error: invalid argument to --extract-jobs: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case OP_RETRIES:
+        cfg.retries = strtol(optarg, &token, 10);
+        if (*token != '\0' || cfg.retries < 0) {
+          fprintf(stderr, "error: invalid argument to --retries: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case OP_HEDGE:
+        cfg.hedge |= 1;
+        break;
+      case OP_MAXRATE:
+        if (parse_rate(optarg, &cfg.max_rate) != 0) {
+          fprintf(stderr, "error: invalid argument to --max-rate: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case OP_DEADLINE:
+        cfg.deadline = strtol(optarg, &token, 10);
+        if (*token != '\0' || cfg.deadline <= 0) {
+          fprintf(stderr, "error: invalid argument to --deadline: %s\n", optarg);
+          return 1;
+        }
+        break;
       case OP_TIMEOUT:
         cfg.timeout = strtol(optarg, &token, 10);
         if (*token != '\0' || cfg.timeout < 0) {
@@ -1253,6 +2938,26 @@ int parse_options(int argc, char *argv[]) {
           return 1;
         }
         break;
+      case OP_CACHEDIR:
+        free(cfg.cache_dir);
+        if (*optarg == '/') {
+          cfg.cache_dir = strdup(optarg);
+        } else {
+          /* anchor it now, before we chdir to the target dir */
+          char *cwd = getcwd(NULL, 0);
+          if (cwd == NULL || asprintf(&cfg.cache_dir, "%s/%s", cwd, optarg) < 0) {
+            cfg.cache_dir = NULL;
+          }
+          free(cwd);
+        }
+        if (cfg.cache_dir == NULL) {
+          fprintf(stderr, "error: failed to resolve --cachedir: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case OP_OFFLINE:
+        cfg.offline |= 1;
+        break;
       case OP_SEARCHBY:
         if (streq(optarg, "maintainer")) {
           cfg.search_by = SEARCHBY_MAINTAINER;
@@ -1283,6 +2988,11 @@ int parse_options(int argc, char *argv[]) {
     return 1;
   }
 
+  if (cfg.offline && cfg.opmask != OP_DOWNLOAD) {
+    fprintf(stderr, "error: --offline can only be used with --download\n");
+    return 1;
+  }
+
   if (allow_regex()) {
     int i;
 
@@ -1345,6 +3055,33 @@ int parse_keyname(char* keyname) {
   return 1;
 }
 
+/* A rate in bytes per second, optionally suffixed with K, M or G. */
+int parse_rate(const char *str, long *rate) {
+  char *end;
+  long r;
+
+  r = strtol(str, &end, 10);
+  switch (*end) {
+    case 'G': case 'g':
+      r *= 1024;
+      /* fallthrough */
+    case 'M': case 'm':
+      r *= 1024;
+      /* fallthrough */
+    case 'K': case 'k':
+      r *= 1024;
+      end++;
+      break;
+  }
+
+  if (end == str || *end != '\0' || r < 0) {
+    return 1;
+  }
+
+  *rate = r;
+  return 0;
+}
+
 int pkg_is_binary(const char *pkg) {
   const char *db = alpm_provides_pkg(pkg);
 
@@ -1360,6 +3097,52 @@ int pkg_is_binary(const char *pkg) {
   return 0;
 }
 
+/* Remove files the previous snapshot had but the current one doesn't. Only
+ * files cower itself extracted are considered, so anything a build left
+ * behind in the pkgbase directory is untouched. */
+void remove_stale_files(const alpm_list_t *previous, const alpm_list_t *current) {
+  strset_t *keep = NULL;
+  const alpm_list_t *i;
+
+  if (previous == NULL) {
+    return;
+  }
+
+  /* if the current files can't all be remembered, removing anything could
+   * take one of them with it */
+  if (strset_new(&keep) < 0) {
+    return;
+  }
+
+  for (i = current; i; i = i->next) {
+    if (strset_add(keep, i->data, strlen(i->data), NULL) < 0) {
+      strset_free(keep);
+      return;
+    }
+  }
+
+  for (i = previous; i; i = i->next) {
+    const char *file = i->data;
+
+    if (strset_contains(keep, file, strlen(file))) {
+      continue;
+    }
+
+    /* never follow a marker outside of the working directory */
+    if (*file == '/' || strstr(file, "..") != NULL) {
+      continue;
+    }
+
+    cwr_printf(LOG_DEBUG, "removing stale file: %s\n", file);
+    if (unlink(file) < 0 && errno != ENOENT) {
+      cwr_fprintf(stderr, LOG_WARN, "failed to remove stale file %s: %s\n",
+          file, strerror(errno));
+    }
+  }
+
+  strset_free(keep);
+}
+
 void pkgbuild_get_depends(char *pkgbuild, alpm_list_t **deplist) {
   char *lineptr;
 
@@ -1396,64 +3179,87 @@ void pkgbuild_get_depends(char *pkgbuild, alpm_list_t **deplist) {
   }
 }
 
-int print_escaped(const char *delim) {
-  const char *f;
-  int out = 0;
+/* Expand the escape at *src, and step past it. */
+static size_t unescape(const char **src, char *dst) {
+  const char *p = *src + 1;
 
-  for (f = delim; *f != '\0'; f++) {
-    if (*f == '\\') {
-      switch(*++f) {
-        case '\\':
-          fputc('\\', stdout);
-          break;
-        case '"':
-          fputc('\"', stdout);
-          break;
-        case 'a':
-          fputc('\a', stdout);
-          break;
-        case 'b':
-          fputc('\b', stdout);
-          break;
-        case 'e': /* \e is nonstandard */
-          fputc('\033', stdout);
-          break;
-        case 'n':
-          fputc('\n', stdout);
-          break;
-        case 'r':
-          fputc('\r', stdout);
-          break;
-        case 't':
-          fputc('\t', stdout);
-          break;
-        case 'v':
-          fputc('\v', stdout);
-          break;
-      }
-      ++out;
-    } else {
-      fputc(*f, stdout);
-      ++out;
-    }
+  if (*p == '\0') {
+    /* a trailing backslash stands for itself */
+    *src = p;
+    *dst = '\\';
+    return 1;
+  }
+
+  *src = p + 1;
+  switch (*p) {
+    case '\\':
+      *dst = '\\';
+      return 1;
+    case '"':
+      *dst = '"';
+      return 1;
+    case 'a':
+      *dst = '\a';
+      return 1;
+    case 'b':
+      *dst = '\b';
+      return 1;
+    case 'e': /* \e is nonstandard */
+      *dst = '\033';
+      return 1;
+    case 'n':
+      *dst = '\n';
+      return 1;
+    case 'r':
+      *dst = '\r';
+      return 1;
+    case 't':
+      *dst = '\t';
+      return 1;
+    case 'v':
+      *dst = '\v';
+      return 1;
+    default:
+      return 0;
   }
+}
+
+/* The field name, padded out to where its value starts. */
+static int print_label(const char *fieldname) {
+  const int len = strlen(fieldname);
+  const int pad = len < kInfoIndent - 2 ? kInfoIndent - 2 - len : 0;
+
+  output_write(output, fieldname, len);
+  output_pad(output, pad);
+  output_write(output, ": ", 2);
 
-  return out;
+  return len + pad + 2;
 }
 
-void print_colored(const char *fieldname, const char *color, const char *value) {
-  printf("%-*s: %s%s%s\n", kInfoIndent - 2, fieldname, color ? color : "", value, color ? colstr.nc : "");
+void print_colored(const char *fieldname, const char *color, size_t colorlen,
+    const char *value) {
+  print_label(fieldname);
+  output_write(output, color, colorlen);
+  output_puts(output, value ? value : "(null)");
+  if (colorlen > 0) {
+    output_write(output, colstr.nc, collen.nc);
+  }
+  output_putc(output, '\n');
 }
 
 void print_time(const char *fieldname, time_t *timestamp) {
   char str[42];
   struct tm t;
 
-  strftime(str, 42, "%c", localtime_r(timestamp, &t));
-  printf("%-*s: %s\n", kInfoIndent - 2, fieldname, str);
+  print_label(fieldname);
+  output_write(output, str, strftime(str, 42, "%c", localtime_r(timestamp, &t)));
+  output_putc(output, '\n');
 }
 
-void print_extinfo_list(char **list, const char *fieldname, const char *delim, int wrap) {
+/* Items are separated by kListDelim, which has no escapes to expand, so it
+ * goes out in one piece. */
+void print_extinfo_list(char **list, const char *fieldname, int wrap) {
+  const size_t delimlen = sizeof(kListDelim) - 1;
   char **i, **next;
   size_t cols, count = 0;
 
@@ -1464,166 +3270,376 @@ void print_extinfo_list(char **list, const char *fieldname, const char *delim, i
   cols = wrap ? getcols() : 0;
 
   if (fieldname) {
-    count += printf("%-*s: ", kInfoIndent - 2, fieldname);
+    count += print_label(fieldname);
   }
 
   for (i = list; *i; i = next) {
     size_t data_len = strlen(*i);
     next = i + 1;
     if (wrap && cols > 0 && count + data_len >= cols) {
-      printf("%-*c", kInfoIndent + 1, '\n');
+      output_putc(output, '\n');
+      output_pad(output, kInfoIndent);
       count = kInfoIndent;
     }
     count += data_len;
-    fputs(*i, stdout);
+    output_write(output, *i, data_len);
     if (next) {
-      count += print_escaped(delim);
+      output_write(output, kListDelim, delimlen);
+      count += delimlen;
     }
   }
   if (wrap) {
-    fputc('\n', stdout);
+    output_putc(output, '\n');
   }
 }
 
-void print_pkg_formatted(aurpkg_t *pkg) {
+/* Add a character to the literal text, extending the last step if it's
+ * literal too. */
+int format_literal(char c) {
+  struct format_op_t *op = format.count ? &format.ops[format.count - 1] : NULL;
+
+  if (op == NULL || op->kind != FORMAT_LITERAL || op->offset + op->len != format.textlen) {
+    op = &format.ops[format.count++];
+    op->kind = FORMAT_LITERAL;
+    op->offset = format.textlen;
+    op->len = 0;
+  }
+
+  format.text[format.textlen++] = c;
+  op->len++;
+
+  return 0;
+}
+
+/* Turn fmt into steps, so that printing a package needn't parse it again. */
+int format_compile(const char *fmt, const char *delim) {
   const char *p;
-  char fmt[32], buf[64];
-  int len;
+  char c;
+
+  /* neither expanding escapes nor turning conversions into steps ever makes
+   * anything longer */
+  format.ops = calloc(strlen(fmt) + 1, sizeof(*format.ops));
+  format.text = malloc(strlen(fmt) + strlen(delim) + 1);
+  if (format.ops == NULL || format.text == NULL) {
+    format_free();
+    return -ENOMEM;
+  }
+
+  for (p = delim; *p;) {
+    if (*p == '\\') {
+      format.delim_len += unescape(&p, format.text + format.delim_len);
+    } else {
+      format.text[format.delim_len++] = *p++;
+    }
+  }
+  format.textlen = format.delim_len;
+
+  for (p = fmt; *p;) {
+    struct format_op_t *op;
+    const char *spec;
+    size_t flags, digits;
+    long width;
+
+    if (*p == '\\') {
+      if (unescape(&p, &c) > 0) {
+        format_literal(c);
+      }
+      continue;
+    } else if (*p != '%') {
+      format_literal(*p++);
+      continue;
+    }
+
+    /* printf flags do nothing for strings, except for left justification */
+    spec = p + 1;
+    flags = strspn(spec, kPrintfFlags);
+    digits = strspn(spec + flags, kDigits);
+    c = spec[flags + digits];
+    p = spec + flags + digits + (c != '\0');
+
+    op = &format.ops[format.count];
+    switch (c) {
+      case 'a': case 'b': case 'd': case 'i': case 'm': case 'n': case 'o':
+      case 'p': case 'r': case 's': case 't': case 'u': case 'v': case 'w':
+        op->kind = FORMAT_FIELD;
+        op->field = c;
+        op->left = memchr(spec, '-', flags) != NULL;
+        width = digits ? strtol(spec + flags, NULL, 10) : 0;
+        op->width = width > INT_MAX ? INT_MAX : (int)width;
+        format.count++;
+        break;
+      case 'C':
+        op->kind = FORMAT_LIST;
+        op->list = offsetof(aurpkg_t, conflicts);
+        format.count++;
+        break;
+      case 'K':
+        op->kind = FORMAT_LIST;
+        op->list = offsetof(aurpkg_t, checkdepends);
+        format.count++;
+        break;
+      case 'D':
+        op->kind = FORMAT_LIST;
+        op->list = offsetof(aurpkg_t, depends);
+        format.count++;
+        break;
+      case 'M':
+        op->kind = FORMAT_LIST;
+        op->list = offsetof(aurpkg_t, makedepends);
+        format.count++;
+        break;
+      case 'O':
+        op->kind = FORMAT_LIST;
+        op->list = offsetof(aurpkg_t, optdepends);
+        format.count++;
+        break;
+      case 'P':
+        op->kind = FORMAT_LIST;
+        op->list = offsetof(aurpkg_t, provides);
+        format.count++;
+        break;
+      case 'R':
+        op->kind = FORMAT_LIST;
+        op->list = offsetof(aurpkg_t, replaces);
+        format.count++;
+        break;
+      case 'W':
+        op->kind = FORMAT_LIST;
+        op->list = offsetof(aurpkg_t, keywords);
+        format.count++;
+        break;
+      case 'G':
+        op->kind = FORMAT_LIST;
+        op->list = offsetof(aurpkg_t, groups);
+        format.count++;
+        break;
+      case 'L':
+        op->kind = FORMAT_LIST;
+        op->list = offsetof(aurpkg_t, licenses);
+        format.count++;
+        break;
+      case '%':
+        format_literal('%');
+        break;
+      default:
+        format_literal('?');
+        break;
+    }
+  }
+
+  return 0;
+}
+
+void format_free(void) {
+  free(format.ops);
+  free(format.text);
+  memset(&format, 0, sizeof(format));
+}
+
+void format_field(const struct format_op_t *op, const aurpkg_t *pkg) {
+  static const char kPackagesPath[] = "/packages/";
+  char num[64];
+  const char *str = num;
+  size_t len = 0, pad;
+
+  switch (op->field) {
+    case 'a':
+      output_long(output, pkg->modified_s, op->width, op->left);
+      return;
+    case 'b':
+      str = pkg->pkgbase;
+      break;
+    case 'd':
+      str = pkg->description ? pkg->description : "";
+      break;
+    case 'i':
+      output_long(output, pkg->package_id, op->width, op->left);
+      return;
+    case 'm':
+      str = pkg->maintainer ? pkg->maintainer : "(orphan)";
+      break;
+    case 'n':
+      str = pkg->name;
+      break;
+    case 'o':
+      output_long(output, pkg->votes, op->width, op->left);
+      return;
+    case 'p':
+      /* the only field made of parts, so it's written here in full */
+      len = strlen("https://") + strlen(cfg.aur_domain) + strlen(kPackagesPath) + strlen(pkg->name);
+      pad = (size_t)op->width > len ? op->width - len : 0;
+      if (!op->left) {
+        output_pad(output, pad);
+      }
+      output_puts(output, "https://");
+      output_puts(output, cfg.aur_domain);
+      output_write(output, kPackagesPath, strlen(kPackagesPath));
+      output_puts(output, pkg->name);
+      if (op->left) {
+        output_pad(output, pad);
+      }
+      return;
+    case 'r':
+      len = snprintf(num, sizeof(num), "%.2f", pkg->popularity);
+      break;
+    case 's':
+      output_long(output, pkg->submitted_s, op->width, op->left);
+      return;
+    case 't':
+      str = pkg->out_of_date ? "yes" : "no";
+      break;
+    case 'u':
+      str = pkg->upstream_url;
+      break;
+    case 'v':
+      str = pkg->version;
+      break;
+    case 'w':
+      output_long(output, pkg->out_of_date, op->width, op->left);
+      return;
+    default:
+      return;
+  }
+
+  if (str == NULL) {
+    /* what printf would have made of it */
+    str = "(null)";
+  }
+  if (str != num) {
+    len = strlen(str);
+  }
+
+  pad = (size_t)op->width > len ? op->width - len : 0;
+  if (!op->left) {
+    output_pad(output, pad);
+  }
+  output_write(output, str, len);
+  if (op->left) {
+    output_pad(output, pad);
+  }
+}
+
+void print_pkg_formatted(aurpkg_t *pkg) {
+  const char *delim = format.text;
+  size_t i;
 
   if (pkg->ignored) {
     return;
   }
 
-  for (p = cfg.format; *p; p++) {
-    len = 0;
-    if (*p == '%') {
-      len = strspn(p + 1 + len, kPrintfFlags);
-      len += strspn(p + 1 + len, kDigits);
-      snprintf(fmt, len + 3, "%ss", p);
-      fmt[len + 1] = 's';
-      p += len + 1;
-      switch(*p) {
-        /* simple attributes */
-        case 'a':
-          snprintf(buf, 64, "%ld", pkg->modified_s);
-          printf(fmt, buf);
-          break;
-        case 'b':
-          printf(fmt, pkg->pkgbase);
-          break;
-        case 'd':
-          printf(fmt, pkg->description ? pkg->description : "");
-          break;
-        case 'i':
-          snprintf(buf, 64, "%d", pkg->package_id);
-          printf(fmt, buf);
-          break;
-        case 'm':
-          printf(fmt, pkg->maintainer ? pkg->maintainer : "(orphan)");
-          break;
-        case 'n':
-          printf(fmt, pkg->name);
-          break;
-        case 'o':
-          snprintf(buf, 64, "%d", pkg->votes);
-          printf(fmt, buf);
-          break;
-        case 'p':
-          snprintf(buf, 64, "https://%s/packages/%s", cfg.aur_domain, pkg->name);
-          printf(fmt, buf);
-          break;
-        case 'r':
-          snprintf(buf, 64, "%.2f", pkg->popularity);
-          printf(fmt, buf);
-          break;
-        case 's':
-          snprintf(buf, 64, "%ld", pkg->submitted_s);
-          printf(fmt, buf);
-          break;
-        case 't':
-          printf(fmt, pkg->out_of_date ? "yes" : "no");
-          break;
-        case 'u':
-          printf(fmt, pkg->upstream_url);
-          break;
-        case 'v':
-          printf(fmt, pkg->version);
-          break;
-        case 'w':
-          snprintf(buf, 64, "%ld", pkg->out_of_date);
-          printf(fmt, buf);
-          break;
-        /* list based attributes */
-        case 'C':
-          print_extinfo_list(pkg->conflicts, NULL, cfg.delim, 0);
-          break;
-        case 'K':
-          print_extinfo_list(pkg->checkdepends, NULL, cfg.delim, 0);
-          break;
-        case 'D':
-          print_extinfo_list(pkg->depends, NULL, cfg.delim, 0);
-          break;
-        case 'M':
-          print_extinfo_list(pkg->makedepends, NULL, cfg.delim, 0);
-          break;
-        case 'O':
-          print_extinfo_list(pkg->optdepends, NULL, cfg.delim, 0);
-          break;
-        case 'P':
-          print_extinfo_list(pkg->provides, NULL, cfg.delim, 0);
-          break;
-        case 'R':
-          print_extinfo_list(pkg->replaces, NULL, cfg.delim, 0);
-          break;
-        case 'W':
-          print_extinfo_list(pkg->keywords, NULL, cfg.delim, 0);
-          break;
-        case 'G':
-          print_extinfo_list(pkg->groups, NULL, cfg.delim, 0);
-          break;
-        case 'L':
-          print_extinfo_list(pkg->licenses, NULL, cfg.delim, 0);
-          break;
-        case '%':
-          fputc('%', stdout);
-          break;
-        default:
-          fputc('?', stdout);
-          break;
-      }
-    } else if (*p == '\\') {
-      char ebuf[3];
-      ebuf[0] = *p;
-      ebuf[1] = *++p;
-      ebuf[2] = '\0';
-      print_escaped(ebuf);
-    } else {
-      fputc(*p, stdout);
+  for (i = 0; i < format.count; i++) {
+    const struct format_op_t *op = &format.ops[i];
+    char **list;
+
+    switch (op->kind) {
+      case FORMAT_LITERAL:
+        output_write(output, format.text + op->offset, op->len);
+        break;
+      case FORMAT_FIELD:
+        format_field(op, pkg);
+        break;
+      case FORMAT_LIST:
+        /* every item is followed by the delimiter, the last one included */
+        for (list = *(char ***)((char *)pkg + op->list); list && *list; list++) {
+          output_puts(output, *list);
+          output_write(output, delim, format.delim_len);
+        }
+        break;
+    }
+  }
+}
+
+static void json_print(void *ctx, const char *str, size_t len) {
+  (void)ctx;
+
+  output_write(output, str, len);
+}
+
+int json_open(void) {
+  jsongen = yajl_gen_alloc(NULL);
+  if (jsongen == NULL) {
+    return -ENOMEM;
+  }
+
+  yajl_gen_config(jsongen, yajl_gen_print_callback, json_print, NULL);
+
+  /* the results go into this as they're printed, and it's closed at exit */
+  if (cfg.json == JSON_ARRAY && yajl_gen_array_open(jsongen) != yajl_gen_status_ok) {
+    json_close();
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+void json_close(void) {
+  int r;
+
+  if (jsongen == NULL) {
+    return;
+  }
+
+  if (cfg.json == JSON_ARRAY) {
+    yajl_gen_array_close(jsongen);
+    output_putc(output, '\n');
+
+    r = output_flush(output);
+    if (r < 0 && r != -EPIPE) {
+      cwr_fprintf(stderr, LOG_ERROR, "failed to write results: %s\n", strerror(-r));
     }
   }
 
-  return;
+  yajl_gen_free(jsongen);
+  jsongen = NULL;
+}
+
+void print_pkg_json(aurpkg_t *pkg) {
+  if (pkg->ignored) {
+    return;
+  }
+
+  if (aur_package_to_json(pkg, jsongen) < 0) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to write %s as JSON\n", pkg->name);
+  }
+
+  if (cfg.json == JSON_LINES) {
+    output_putc(output, '\n');
+    yajl_gen_reset(jsongen, NULL);
+  }
 }
 
 void print_pkg_installed_tag(aurpkg_t *pkg) {
   alpm_pkg_t *local_pkg;
-  const char *instcolor;
+  const char *instcolor, *localver;
+  size_t instlen;
 
   local_pkg = alpm_db_get_pkg(db_local, pkg->name);
   if (local_pkg == NULL) {
     return;
   }
 
-  instcolor = alpm_pkg_vercmp(pkg->version, alpm_pkg_get_version(local_pkg)) > 0
-    ? colstr.ood
-    : colstr.utd;
+  localver = alpm_pkg_get_version(local_pkg);
+  if (alpm_pkg_vercmp(pkg->version, localver) > 0) {
+    instcolor = colstr.ood;
+    instlen = collen.ood;
+  } else {
+    instcolor = colstr.utd;
+    instlen = collen.utd;
+  }
 
-  if (streq(pkg->version, alpm_pkg_get_version(local_pkg))) {
-    printf(" %s[%sinstalled%s]%s", colstr.url, instcolor, colstr.url, colstr.nc);
+  output_putc(output, ' ');
+  output_write(output, colstr.url, collen.url);
+  output_putc(output, '[');
+  output_write(output, instcolor, instlen);
+  if (streq(pkg->version, localver)) {
+    output_puts(output, "installed");
   } else {
-    printf(" %s[%sinstalled: %s%s]%s", colstr.url, instcolor,
-        alpm_pkg_get_version(local_pkg), colstr.url, colstr.nc);
+    output_puts(output, "installed: ");
+    output_puts(output, localver);
   }
+  output_write(output, colstr.url, collen.url);
+  output_putc(output, ']');
+  output_write(output, colstr.nc, collen.nc);
 }
 
 void print_pkg_info(aurpkg_t *pkg) {
@@ -1631,63 +3647,89 @@ void print_pkg_info(aurpkg_t *pkg) {
     return;
   }
 
-  print_colored("Repository", colstr.repo, "aur");
-  printf("Name           : %s%s%s", colstr.pkg, pkg->name, colstr.nc);
+  print_colored("Repository", colstr.repo, collen.repo, "aur");
+  print_label("Name");
+  output_write(output, colstr.pkg, collen.pkg);
+  output_puts(output, pkg->name);
+  output_write(output, colstr.nc, collen.nc);
   print_pkg_installed_tag(pkg);
-  fputc('\n', stdout);
+  output_putc(output, '\n');
 
   if (!streq(pkg->name, pkg->pkgbase)) {
-    print_colored("PackageBase", colstr.pkg, pkg->pkgbase);
+    print_colored("PackageBase", colstr.pkg, collen.pkg, pkg->pkgbase);
   }
 
-  print_colored("Version", pkg->out_of_date ? colstr.ood : colstr.utd, pkg->version);
-  print_colored("URL", colstr.url, pkg->upstream_url);
-  printf("AUR Page       : %shttps://%s/packages/%s%s\n",
-      colstr.url, cfg.aur_domain, pkg->name, colstr.nc);
+  if (pkg->out_of_date) {
+    print_colored("Version", colstr.ood, collen.ood, pkg->version);
+  } else {
+    print_colored("Version", colstr.utd, collen.utd, pkg->version);
+  }
+  print_colored("URL", colstr.url, collen.url, pkg->upstream_url);
+  print_label("AUR Page");
+  output_write(output, colstr.url, collen.url);
+  output_puts(output, "https://");
+  output_puts(output, cfg.aur_domain);
+  output_puts(output, "/packages/");
+  output_puts(output, pkg->name);
+  output_write(output, colstr.nc, collen.nc);
+  output_putc(output, '\n');
   if (pkg->keywords) {
-    print_extinfo_list(pkg->keywords, "Keywords", kListDelim, 1);
+    print_extinfo_list(pkg->keywords, "Keywords", 1);
   }
-  print_extinfo_list(pkg->groups, "Groups", kListDelim, 1);
+  print_extinfo_list(pkg->groups, "Groups", 1);
 
-  print_extinfo_list(pkg->depends, "Depends On", kListDelim, 1);
-  print_extinfo_list(pkg->makedepends, "Makedepends", kListDelim, 1);
-  print_extinfo_list(pkg->checkdepends, "Checkdepends", kListDelim, 1);
-  print_extinfo_list(pkg->provides, "Provides", kListDelim, 1);
-  print_extinfo_list(pkg->conflicts, "Conflicts With", kListDelim, 1);
+  print_extinfo_list(pkg->depends, "Depends On", 1);
+  print_extinfo_list(pkg->makedepends, "Makedepends", 1);
+  print_extinfo_list(pkg->checkdepends, "Checkdepends", 1);
+  print_extinfo_list(pkg->provides, "Provides", 1);
+  print_extinfo_list(pkg->conflicts, "Conflicts With", 1);
 
   if (pkg->optdepends) {
     char **i = pkg->optdepends;
-    printf("Optional Deps  : %s\n", *i);
+    print_label("Optional Deps");
+    output_puts(output, *i);
+    output_putc(output, '\n');
     while (*++i) {
-      printf("%-*s%s\n", kInfoIndent, "", *i);
+      output_pad(output, kInfoIndent);
+      output_puts(output, *i);
+      output_putc(output, '\n');
     }
   }
 
-  print_extinfo_list(pkg->replaces, "Replaces", kListDelim, 1);
-  print_extinfo_list(pkg->licenses, "License", kListDelim, 1);
+  print_extinfo_list(pkg->replaces, "Replaces", 1);
+  print_extinfo_list(pkg->licenses, "License", 1);
 
-  printf("Votes          : %d\n", pkg->votes);
-  printf("Popularity     : %.2f\n", pkg->popularity);
+  print_label("Votes");
+  output_long(output, pkg->votes, 0, 0);
+  output_putc(output, '\n');
+  print_label("Popularity");
+  output_printf(output, "%.2f\n", pkg->popularity);
 
-  printf("Out of Date    : ");
+  print_label("Out of Date");
   if (pkg->out_of_date) {
     char str[42];
     struct tm t;
 
-    strftime(str, 42, "%c", localtime_r(&pkg->out_of_date, &t));
-
-    printf("%sYes%s [%s]\n", colstr.ood, colstr.nc, str);
+    output_write(output, colstr.ood, collen.ood);
+    output_puts(output, "Yes");
+    output_write(output, colstr.nc, collen.nc);
+    output_puts(output, " [");
+    output_write(output, str, strftime(str, 42, "%c", localtime_r(&pkg->out_of_date, &t)));
+    output_puts(output, "]\n");
   } else {
-    printf("%sNo%s\n", colstr.utd, colstr.nc);
+    output_write(output, colstr.utd, collen.utd);
+    output_puts(output, "No");
+    output_write(output, colstr.nc, collen.nc);
+    output_putc(output, '\n');
   }
 
-  print_colored("Maintainer", NULL, pkg->maintainer ? pkg->maintainer : "(orphan)");
+  print_colored("Maintainer", NULL, 0, pkg->maintainer ? pkg->maintainer : "(orphan)");
   print_time("Submitted", &pkg->submitted_s);
   print_time("Last Modified", &pkg->modified_s);
 
-  printf("Description    : ");
+  print_label("Description");
   indentprint(pkg->description, kInfoIndent);
-  fputs("\n\n", stdout);
+  output_write(output, "\n\n", 2);
 }
 
 void print_pkg_search(aurpkg_t *pkg) {
@@ -1696,57 +3738,333 @@ void print_pkg_search(aurpkg_t *pkg) {
   }
 
   if (cfg.quiet) {
-    printf("%s%s%s\n", colstr.pkg, pkg->name, colstr.nc);
+    output_write(output, colstr.pkg, collen.pkg);
+    output_puts(output, pkg->name);
+    output_write(output, colstr.nc, collen.nc);
+    output_putc(output, '\n');
   } else {
-    printf("%saur/%s%s%s %s%s%s%s (%d, %.2f)", colstr.repo, colstr.nc, colstr.pkg,
-        pkg->name, pkg->out_of_date ? colstr.ood : colstr.utd, pkg->version,
-        NCFLAG(pkg->out_of_date, " <!>"), colstr.nc, pkg->votes, pkg->popularity);
+    output_write(output, colstr.repo, collen.repo);
+    output_puts(output, "aur/");
+    output_write(output, colstr.nc, collen.nc);
+    output_write(output, colstr.pkg, collen.pkg);
+    output_puts(output, pkg->name);
+    output_putc(output, ' ');
+    if (pkg->out_of_date) {
+      output_write(output, colstr.ood, collen.ood);
+    } else {
+      output_write(output, colstr.utd, collen.utd);
+    }
+    output_puts(output, pkg->version);
+    output_puts(output, NCFLAG(pkg->out_of_date, " <!>"));
+    output_write(output, colstr.nc, collen.nc);
+    output_puts(output, " (");
+    output_long(output, pkg->votes, 0, 0);
+    output_printf(output, ", %.2f)", pkg->popularity);
     print_pkg_installed_tag(pkg);
-    printf("\n    ");
+    output_puts(output, "\n    ");
     indentprint(pkg->description, kSearchIndent);
-    fputc('\n', stdout);
+    output_putc(output, '\n');
   }
 }
 
 void print_results(aurpkg_t **packages, void (*printfn)(aurpkg_t*)) {
   aurpkg_t **r;
+  int ret;
 
   if (printfn == NULL || packages == NULL) {
     return;
   }
 
+  /* anything already on its way out through stdio goes first */
+  fflush(stdout);
+
   qsort(packages, aur_packages_count(packages), sizeof(*packages), aurpkg_cmp);
   for (r = packages; *r; r++) {
     printfn(*r);
   }
+
+  ret = output_flush(output);
+  if (ret < 0 && ret != -EPIPE) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to write results: %s\n", strerror(-ret));
+  }
 }
 
-void resolve_one_dep(struct task_t *task, const char *depend) {
-  char *sanitized = strdup(depend);
+int stream_open(void (*printfn)(aurpkg_t*)) {
+  locale_t base;
+  int r;
+
+  r = strset_new(&stream.seen);
+  if (r < 0) {
+    return r;
+  }
+
+  base = cfg.json ? (locale_t)0 : duplocale(LC_GLOBAL_LOCALE);
+  if (base != (locale_t)0) {
+    stream.locale = newlocale(LC_NUMERIC_MASK, "", base);
+    if (stream.locale == (locale_t)0) {
+      freelocale(base);
+    }
+  }
+
+  /* with --from-pkgbuild, the targets are filenames rather than patterns */
+  if (allow_regex() && !cfg.frompkgbuild) {
+    const alpm_list_t *i;
 
-  sanitized[strcspn(sanitized, "<>=")] = '\0';
+    stream.patterns = calloc(alpm_list_count(cfg.targets), sizeof(*stream.patterns));
+    if (stream.patterns == NULL) {
+      stream_close();
+      return -ENOMEM;
+    }
 
-  if (!alpm_list_find_str(cfg.targets, sanitized)) {
-    pthread_mutex_lock(&listlock);
-    cfg.targets = alpm_list_add(cfg.targets, sanitized);
-    pthread_mutex_unlock(&listlock);
-  } else {
-    free(sanitized);
+    /* these should succeed since we validated the regexes up front */
+    for (i = cfg.targets; i; i = i->next) {
+      if (regcomp(&stream.patterns[stream.npatterns], i->data, kRegexOpts) == 0) {
+        stream.npatterns++;
+      }
+    }
+  }
+
+  stream.printfn = printfn;
+  return 0;
+}
+
+void stream_close(void) {
+  int i;
+
+  for (i = 0; i < stream.npatterns; i++) {
+    regfree(&stream.patterns[i]);
+  }
+  free(stream.patterns);
+  strset_free(stream.seen);
+  if (stream.locale != (locale_t)0) {
+    freelocale(stream.locale);
+  }
+
+  stream.printfn = NULL;
+  stream.seen = NULL;
+  stream.patterns = NULL;
+  stream.npatterns = 0;
+  stream.locale = (locale_t)0;
+}
+
+/* Print whatever in packages makes it through the same filtering as
+ * filter_results, skipping anything printed already. */
+void stream_results(aurpkg_t **packages) {
+  locale_t prev = (locale_t)0;
+  aurpkg_t **p;
+  int i, r;
+
+  pthread_mutex_lock(&stream.lock);
+
+  if (stream.failed) {
+    pthread_mutex_unlock(&stream.lock);
+    return;
+  }
+
+  if (stream.locale != (locale_t)0) {
+    prev = uselocale(stream.locale);
+  }
+
+  /* anything already on its way out through stdio goes first */
+  fflush(stdout);
+
+  for (p = packages; *p; p++) {
+    aurpkg_t *pkg = *p;
+
+    if (pkg->ignored) {
+      continue;
+    }
+
+    for (i = 0; i < stream.npatterns; i++) {
+      if (should_ignore_package(pkg, &stream.patterns[i])) {
+        break;
+      }
+    }
+    if (i < stream.npatterns) {
+      continue;
+    }
+
+    if (strset_add(stream.seen, pkg->name, strlen(pkg->name), NULL) > 0) {
+      stream.printfn(pkg);
+    }
+  }
+
+  r = output_flush(output);
+  if (r < 0) {
+    /* nobody's listening anymore, so don't bother with the rest */
+    if (r != -EPIPE) {
+      cwr_fprintf(stderr, LOG_ERROR, "failed to write results: %s\n", strerror(-r));
+    }
+    stream.failed = 1;
+  }
+
+  if (prev != (locale_t)0) {
+    uselocale(prev);
+  }
+
+  pthread_mutex_unlock(&stream.lock);
+}
+
+void resolve_one_dep(const char *depend) {
+  const char *sanitized;
+
+  if (strset_add(scheduled, depend, strcspn(depend, "<>="), &sanitized) <= 0) {
     return;
   }
 
   if (alpm_find_satisfier(alpm_db_get_pkgcache(db_local), depend)) {
     cwr_printf(LOG_DEBUG, "%s is already satisified\n", depend);
-  } else {
-    if (!pkg_is_binary(depend)) {
-      aur_packages_free(task_download(task, sanitized));
+  } else if (!pkg_is_binary(depend)) {
+    /* looked up along with the rest of this level once it's done */
+    pthread_mutex_lock(&resolver.lock);
+    resolver.frontier = alpm_list_add(resolver.frontier, (char*)sanitized);
+    pthread_mutex_unlock(&resolver.lock);
+  }
+}
+
+/* Look up an entire level of the dependency tree with as few info requests
+ * as possible, and queue downloads for everything found. */
+void resolve_frontier(alpm_list_t *frontier, struct task_t *task) {
+  _cleanup_free_ const char **names = NULL;
+  _cleanup_free_ int *claimed = NULL, *answered = NULL, *expired = NULL;
+  aurpkg_t **packages = NULL, **p;
+  const alpm_list_t *l;
+  int count, nfetch = 0, consumed, i, j;
+
+  count = alpm_list_count(frontier);
+  names = malloc(count * sizeof(*names));
+  claimed = malloc(count * sizeof(*claimed));
+  answered = calloc(count, sizeof(*answered));
+  expired = calloc(count, sizeof(*expired));
+  if (names == NULL || claimed == NULL || answered == NULL || expired == NULL) {
+    return;
+  }
+
+  /* anything already looked up this run needn't be asked for again. names
+   * someone else is fetching right now are requested anyway rather than
+   * stalling the whole level on them. */
+  for (l = frontier; l; l = l->next) {
+    aurpkg_t *cached;
+
+    /* offline, there's nothing to batch: the store answers directly */
+    if (cfg.offline) {
+      aurpkg_t **single = rpc_info(task, l->data);
+
+      if (single == NULL) {
+        cwr_fprintf(stderr, LOG_ERROR, "no results found for %s\n", (const char *)l->data);
+      } else if (aur_packages_append(&packages, single) < 0) {
+        aur_packages_free(single);
+      }
+      continue;
+    }
+
+    switch (pkgcache_get(infocache, l->data, 0, &cached)) {
+    case PKGCACHE_HIT:
+      if (cached == NULL) {
+        cwr_fprintf(stderr, LOG_ERROR, "no results found for %s\n", (const char *)l->data);
+      } else {
+        aurpkg_t **single = package_list_new(cached);
+
+        if (single == NULL || aur_packages_append(&packages, single) < 0) {
+          aur_package_free(cached);
+          free(single);
+        }
+      }
+      break;
+    case PKGCACHE_MISS:
+      claimed[nfetch] = 1;
+      names[nfetch++] = l->data;
+      break;
+    case PKGCACHE_BUSY:
+      claimed[nfetch] = 0;
+      names[nfetch++] = l->data;
+      break;
+    }
+  }
+
+  cwr_printf(LOG_DEBUG, "resolving a level of %d dependencies (%d cached)\n",
+      count, count - nfetch);
+
+  for (i = 0; i < nfetch; i += consumed) {
+    _cleanup_free_ char *url = NULL;
+    aurpkg_t **batch;
+
+    url = aur_build_rpc_info_url(task->aur, &names[i], nfetch - i, &consumed);
+    if (url == NULL) {
+      break;
+    }
+
+    task->timed_out = 0;
+    batch = rpc_do_url(task, url, names[i]);
+    if (batch != NULL && aur_packages_append(&packages, batch) < 0) {
+      aur_packages_free(batch);
+    }
+
+    for (j = i; j < i + consumed; j++) {
+      answered[j] = task->rpc_answered;
+      expired[j] = task->timed_out;
+    }
+  }
+  task->timed_out = 0;
+
+  for (i = 0; i < nfetch; i++) {
+    int found;
+
+    for (p = packages; p && *p; p++) {
+      if (streq((*p)->name, names[i])) {
+        break;
+      }
+    }
+
+    /* a batch that never got an answer says nothing about whether its
+     * packages exist. let the next caller try again instead. */
+    found = p != NULL && *p != NULL;
+    if (claimed[i]) {
+      if (found || answered[i]) {
+        pkgcache_put(infocache, names[i], found ? *p : NULL);
+      } else {
+        pkgcache_abandon(infocache, names[i]);
+      }
+    }
+
+    /* the deadline cut the batch short, so these are reported along with
+     * everything else it cost us at the end of the run */
+    if (!found && expired[i]) {
+      report_unresolved(names[i]);
+    } else if (!found && answered[i]) {
+      cwr_fprintf(stderr, LOG_ERROR, "no results found for %s\n", names[i]);
+    }
+  }
+
+  for (p = packages; p && *p; p++) {
+    if (queue_job(-1, (*p)->name, NULL, *p, 1) < 0) {
+      cwr_fprintf(stderr, LOG_ERROR, "failed to queue dependency %s\n", (*p)->name);
+      aur_package_free(*p);
     }
   }
 
-  return;
+  free(packages);
+}
+
+/* Called as each job finishes. Once nothing is left running which might add
+ * to the current level of the dependency tree, the level is resolved. */
+void resolver_job_done(struct task_t *task) {
+  alpm_list_t *frontier = NULL;
+
+  pthread_mutex_lock(&resolver.lock);
+  if (--resolver.inflight == 0) {
+    frontier = resolver.frontier;
+    resolver.frontier = NULL;
+  }
+  pthread_mutex_unlock(&resolver.lock);
+
+  if (frontier != NULL) {
+    resolve_frontier(frontier, task);
+    alpm_list_free(frontier);
+  }
 }
 
-void resolve_pkg_dependencies(struct task_t *task, aurpkg_t *package) {
+void resolve_pkg_dependencies(aurpkg_t *package) {
   struct deparray_t {
     char **array;
     const char *name;
@@ -1765,33 +4083,283 @@ void resolve_pkg_dependencies(struct task_t *task, aurpkg_t *package) {
 
       cwr_printf(LOG_DEBUG, "resolving %s for %s\n", d->name, package->name);
       for (p = d->array; *p; ++p) {
-        resolve_one_dep(task, *p);
+        resolve_one_dep(*p);
       }
     }
   }
 }
 
-int ch_working_dir(void) {
-  if (!(cfg.opmask & OP_DOWNLOAD)) {
-    return 0;
-  }
+int resolve_srcinfo_dependencies(aurpkg_t *package) {
+  _cleanup_free_ char *path = NULL;
+  alpm_list_t *deps = NULL, *i;
+  int r;
+
+  if (asprintf(&path, "%s/.SRCINFO", package->pkgbase) < 0) {
+    return -ENOMEM;
+  }
+
+  r = srcinfo_load_depends(path, package->name, &deps);
+  if (r < 0) {
+    cwr_printf(LOG_DEBUG, "failed to read %s: %s\n", path, strerror(-r));
+    return r;
+  }
+
+  cwr_printf(LOG_DEBUG, "resolving dependencies for %s from %s\n", package->name, path);
+  for (i = deps; i; i = i->next) {
+    resolve_one_dep(i->data);
+  }
+  FREELIST(deps);
+
+  return 0;
+}
+
+int ch_working_dir(void) {
+  if (!(cfg.opmask & OP_DOWNLOAD)) {
+    return 0;
+  }
+
+  if (access(cfg.working_dir ? cfg.working_dir : ".", W_OK) != 0) {
+    fprintf(stderr, "error: cannot write to %s: %s\n",
+        cfg.working_dir ? cfg.working_dir : "current directory", strerror(errno));
+    return 1;
+  }
+
+  if (cfg.working_dir && chdir(cfg.working_dir) != 0) {
+      fprintf(stderr, "error: failed to chdir to %s: %s\n", cfg.working_dir,
+          strerror(errno));
+      return 1;
+  }
+
+  free(cfg.working_dir);
+  cfg.working_dir = getcwd(NULL, 0);
+
+  return 0;
+}
+
+/* Hand a fetched snapshot to the extraction stage. Until it's done there, it
+ * counts as work in flight on the network queue and for the resolver, since
+ * extracting it may turn up more dependencies to fetch. */
+int queue_extract(struct extract_job_t *job) {
+  int r;
+
+  /* no extraction stage to hand off to, so do it here */
+  if (extractq == NULL) {
+    diskq_t *q = extract_diskq_new();
+
+    extract_snapshot(job, q);
+    extract_job_free(job);
+    diskq_free(q);
+    return 0;
+  }
+
+  pthread_mutex_lock(&resolver.lock);
+  resolver.inflight++;
+  pthread_mutex_unlock(&resolver.lock);
+  workq_hold(workq);
+
+  r = workq_push(extractq, -1, job);
+  if (r < 0) {
+    pthread_mutex_lock(&resolver.lock);
+    resolver.inflight--;
+    pthread_mutex_unlock(&resolver.lock);
+    workq_done(workq);
+  }
+
+  return r;
+}
+
+void *extract_pool(void *arg) {
+  const int worker = *(int *)arg;
+  /* one ring per worker, kept for every tarball it extracts */
+  diskq_t *q = extract_diskq_new();
+
+  for (;;) {
+    struct extract_job_t *job;
+    alpm_list_t *frontier = NULL;
+
+    job = workq_pop(extractq, worker);
+    if (job == NULL) {
+      break;
+    }
+
+    extract_snapshot(job, q);
+    extract_job_free(job);
+
+    /* looking up the next level is network work, so leave it to that stage */
+    pthread_mutex_lock(&resolver.lock);
+    if (--resolver.inflight == 0) {
+      frontier = resolver.frontier;
+      resolver.frontier = NULL;
+    }
+    pthread_mutex_unlock(&resolver.lock);
+
+    if (frontier != NULL && queue_level(frontier) < 0) {
+      cwr_fprintf(stderr, LOG_ERROR, "failed to queue dependency resolution\n");
+      alpm_list_free(frontier);
+    }
+
+    workq_done(workq);
+    workq_done(extractq);
+  }
+
+  diskq_free(q);
+
+  return NULL;
+}
+
+/* Queue job, counting it as in flight for the resolver. job is freed if it
+ * can't be queued. */
+static int push_job(int worker, struct job_t *job) {
+  int r;
+
+  pthread_mutex_lock(&resolver.lock);
+  resolver.inflight++;
+  pthread_mutex_unlock(&resolver.lock);
+
+  r = workq_push(workq, worker, job);
+  if (r < 0) {
+    pthread_mutex_lock(&resolver.lock);
+    resolver.inflight--;
+    pthread_mutex_unlock(&resolver.lock);
+    free(job);
+    return r;
+  }
+
+  return 0;
+}
+
+int queue_job(int worker, const char *target,
+    aurpkg_t **(*fn)(struct task_t*, const char*), aurpkg_t *package, int dependency) {
+  struct job_t *job;
+
+  job = calloc(1, sizeof(*job));
+  if (job == NULL) {
+    return -ENOMEM;
+  }
+
+  job->target = target;
+  job->fn = fn;
+  job->package = package;
+  job->dependency = dependency;
+
+  return push_job(worker, job);
+}
+
+/* Hand a level of the dependency tree which the extraction stage completed to
+ * the network workers to look up. The job takes ownership of frontier, but
+ * not until it has been queued. */
+int queue_level(alpm_list_t *frontier) {
+  struct job_t *job;
+
+  job = calloc(1, sizeof(*job));
+  if (job == NULL) {
+    return -ENOMEM;
+  }
+
+  job->frontier = frontier;
+  job->dependency = 1;
+
+  return push_job(-1, job);
+}
+
+/* Hand target to the workers unless it was already scheduled. Returns 1 if
+ * the target was queued. */
+int schedule_target(const char *target, size_t len) {
+  const char *key;
+  int r;
+
+  r = strset_add(scheduled, target, len, &key);
+  if (r <= 0) {
+    return r;
+  }
+
+  cwr_printf(LOG_DEBUG, "adding target: %s\n", key);
+
+  r = queue_job(-1, key, NULL, NULL, 0);
+  if (r < 0) {
+    return r;
+  }
+
+  return 1;
+}
+
+static int srcinfo_collect_dep(const struct srcinfo_dep_t *dep, void *userdata) {
+  alpm_list_t **deplist = userdata;
+  char *depend;
+
+  depend = strndup(dep->value.ptr, dep->value.len);
+  if (depend == NULL) {
+    return -ENOMEM;
+  }
+
+  cwr_printf(LOG_DEBUG, "adding depend: %s\n", depend);
+  *deplist = alpm_list_add(*deplist, depend);
+
+  return 0;
+}
+
+/* Collect the depends, makedepends and checkdepends needed to build the
+ * pkgbase described by the .SRCINFO at path. If pkgname is NULL, the runtime
+ * depends of every package in the pkgbase are included, otherwise only those
+ * of pkgname. */
+int srcinfo_load_depends(const char *path, const char *pkgname, alpm_list_t **deplist) {
+  struct mapped_file_t file;
+  srcinfo_t *srcinfo;
+  const char *arch = machine_arch();
+  const unsigned buildmask = SRCINFO_DEPTYPE_MASK(SRCINFO_DEPENDS) |
+      SRCINFO_DEPTYPE_MASK(SRCINFO_MAKEDEPENDS) |
+      SRCINFO_DEPTYPE_MASK(SRCINFO_CHECKDEPENDS);
+  const unsigned pkgmask = SRCINFO_DEPTYPE_MASK(SRCINFO_DEPENDS);
+  size_t i;
+  int r;
+
+  r = map_file(path, &file);
+  if (r < 0) {
+    return r;
+  }
+
+  r = srcinfo_parse(file.data, file.size, &srcinfo);
+  if (r < 0) {
+    unmap_file(&file);
+    return r;
+  }
+
+  r = srcinfo_foreach_dep(srcinfo, NULL, buildmask, arch, srcinfo_collect_dep, deplist);
+  for (i = 0; r == 0 && i < srcinfo->npkgs; ++i) {
+    const struct srcinfo_pkg_t *pkg = &srcinfo->pkgs[i];
+
+    if (pkgname == NULL || srcinfo_find_pkg(srcinfo, pkgname) == pkg) {
+      r = srcinfo_foreach_dep(srcinfo, pkg, pkgmask, arch, srcinfo_collect_dep, deplist);
+    }
+  }
+
+  srcinfo_free(srcinfo);
+  unmap_file(&file);
+
+  return r;
+}
+
+/* Find the .SRCINFO describing the PKGBUILD at path. path may also name the
+ * .SRCINFO itself. */
+char *srcinfo_path_for(const char *path) {
+  const char *slash;
+  char *srcinfo;
 
-  if (access(cfg.working_dir ? cfg.working_dir : ".", W_OK) != 0) {
-    fprintf(stderr, "error: cannot write to %s: %s\n",
-        cfg.working_dir ? cfg.working_dir : "current directory", strerror(errno));
-    return 1;
+  slash = strrchr(path, '/');
+  if (streq(slash ? slash + 1 : path, ".SRCINFO")) {
+    return strdup(path);
   }
 
-  if (cfg.working_dir && chdir(cfg.working_dir) != 0) {
-      fprintf(stderr, "error: failed to chdir to %s: %s\n", cfg.working_dir,
-          strerror(errno));
-      return 1;
+  if (asprintf(&srcinfo, "%.*s.SRCINFO", slash ? (int)(slash - path + 1) : 0, path) < 0) {
+    return NULL;
   }
 
-  free(cfg.working_dir);
-  cfg.working_dir = getcwd(NULL, 0);
+  if (access(srcinfo, R_OK) != 0) {
+    free(srcinfo);
+    return NULL;
+  }
 
-  return 0;
+  return srcinfo;
 }
 
 void strings_init(void) {
@@ -1805,6 +4373,13 @@ void strings_init(void) {
     colstr.ood = BOLDRED;
     colstr.utd = BOLDGREEN;
     colstr.nc = NC;
+
+    collen.pkg = sizeof(BOLD) - 1;
+    collen.repo = sizeof(BOLDMAGENTA) - 1;
+    collen.url = sizeof(BOLDCYAN) - 1;
+    collen.ood = sizeof(BOLDRED) - 1;
+    collen.utd = sizeof(BOLDGREEN) - 1;
+    collen.nc = sizeof(NC) - 1;
   }
 
   /* guard against delim being something other than kListDelim if extinfo
@@ -1847,32 +4422,105 @@ aurpkg_t **task_download(struct task_t *task, const char *arg) {
   }
 }
 
+/* Download an already resolved dependency, taking ownership of it. */
+aurpkg_t **task_download_package(struct task_t *task, aurpkg_t *package) {
+  download_package(task, package, 0);
+  aur_package_free(package);
+
+  return NULL;
+}
+
 aurpkg_t **rpc_do(struct task_t *task, rpc_type type, const char *arg) {
-  struct buffer_t response = { NULL, 0, 0 };
   _cleanup_free_ char *url = NULL;
-  aurpkg_t **packages = NULL;
-  int r, packagecount;
 
+  task->rpc_answered = 0;
   url = aur_build_rpc_url(task->aur, type, cfg.search_by, arg);
   if (url == NULL) {
     return NULL;
   }
 
-  task_reset_for_rpc(task, url, &response);
-  if (task_http_execute(task, url, arg) != 0) {
-    return NULL;
+  return rpc_do_url(task, url, arg);
+}
+
+aurpkg_t **rpc_do_url(struct task_t *task, const char *url, const char *arg) {
+  struct buffer_t *response = &task->rpcbuf;
+  aurpkg_t **packages = NULL;
+  int ok, r = 0, packagecount;
+
+  response->size = 0;
+  if (response->data != NULL) {
+    response->data[0] = '\0';
   }
 
-  r = aur_packages_from_json(response.data, &packages, &packagecount);
-  if (r < 0) {
+  task_reset_for_rpc(task, url, response);
+  ok = task_http_execute(task, url, arg) == 0;
+  if (ok) {
+    r = aur_packages_from_json(response->data, &packages, &packagecount);
+  }
+  task->rpc_answered = ok && r == 0;
+
+  /* hang on to the buffer for the next request, unless an unusually large
+   * response has blown it up */
+  if (response->capacity > (size_t)cfg.buffer_highwater * 1024) {
+    cwr_printf(LOG_DEBUG, "[%s]: releasing %zu byte response buffer\n", arg, response->capacity);
+    free(response->data);
+    response->data = NULL;
+    response->size = response->capacity = 0;
+  }
+
+  if (!ok) {
+    return NULL;
+  } else if (r < 0) {
     cwr_fprintf(stderr, LOG_ERROR, "[%s]: json parsing failed: %s\n", arg, strerror(-r));
     return NULL;
   }
 
-  cwr_printf(LOG_DEBUG, "rpc %d request for %s returned %d results\n",
-      type, arg, packagecount);
+  cwr_printf(LOG_DEBUG, "rpc request for %s returned %d results\n", arg, packagecount);
+
+  return packages;
+}
+
+/* Fetch info for a single package, asking the AUR at most once per run. */
+aurpkg_t **rpc_info(struct task_t *task, const char *name) {
+  aurpkg_t **packages, *cached;
+
+  if (cfg.offline) {
+    cached = offline_package(name);
+    if (cached == NULL) {
+      return NULL;
+    }
+
+    packages = package_list_new(cached);
+    if (packages == NULL) {
+      aur_package_free(cached);
+    }
+
+    return packages;
+  }
+
+  if (pkgcache_get(infocache, name, 1, &cached) == PKGCACHE_HIT) {
+    if (cached == NULL) {
+      return NULL;
+    }
+
+    cwr_printf(LOG_DEBUG, "[%s]: using cached package info\n", name);
+
+    packages = package_list_new(cached);
+    if (packages == NULL) {
+      aur_package_free(cached);
+    }
+
+    return packages;
+  }
 
-  free(response.data);
+  /* only an answer from the AUR says the package doesn't exist. after a
+   * failed request, whoever asks next tries again. */
+  packages = rpc_do(task, RPC_INFO, name);
+  if (packages != NULL || task->rpc_answered) {
+    pkgcache_put(infocache, name, packages ? packages[0] : NULL);
+  } else {
+    pkgcache_abandon(infocache, name);
+  }
 
   return packages;
 }
@@ -1933,6 +4581,10 @@ aurpkg_t **task_query(struct task_t *task, const char *arg) {
     arg = fragment;
   }
 
+  if (rpc_op_from_opmask(cfg.opmask) == RPC_INFO) {
+    return rpc_info(task, arg);
+  }
+
   return rpc_do(task, rpc_op_from_opmask(cfg.opmask), arg);
 }
 
@@ -1943,7 +4595,7 @@ aurpkg_t **task_update(struct task_t *task, const char *arg) {
   cwr_printf(LOG_VERBOSE, "Checking %s%s%s for updates...\n",
       colstr.pkg, arg, colstr.nc);
 
-  packages = rpc_do(task, RPC_INFO, arg);
+  packages = rpc_info(task, arg);
   if (packages == NULL) {
     return NULL;
   }
@@ -1966,7 +4618,10 @@ aurpkg_t **task_update(struct task_t *task, const char *arg) {
     }
 
     if (cfg.opmask & OP_DOWNLOAD) {
-      aur_packages_free(task_download(task, packages[0]->name));
+      /* the info we just checked is all download needs, don't ask again */
+      if (!pkg_is_binary(packages[0]->name)) {
+        download_package(task, packages[0], 0);
+      }
     } else {
       if (cfg.quiet) {
         printf("%s%s%s\n", colstr.pkg, arg, colstr.nc);
@@ -1986,44 +4641,214 @@ finish:
   return NULL;
 }
 
+void unmap_file(struct mapped_file_t *file) {
+  if (file->data != NULL) {
+    munmap(file->data, file->size);
+  }
+}
+
+void update_marker(const aurpkg_t *package, const char *etag, alpm_list_t *files) {
+  struct marker_t marker = {
+    .lastmodified = package->modified_s,
+    .version = package->version,
+    .etag = (char *)etag,
+    .files = files,
+  };
+  int r;
+
+  r = marker_write(package->pkgbase, &marker);
+  if (r < 0) {
+    /* the download itself is still good, it just can't be skipped next time */
+    cwr_fprintf(stderr, LOG_WARN, "[%s]: failed to record snapshot marker: %s\n",
+        package->name, strerror(-r));
+  }
+}
+
+/* Failing to share the budget isn't worth failing over, but it's worth
+ * knowing about, since requests are then no longer rationed. */
+void open_budget(void) {
+  char cache_path[PATH_MAX];
+  _cleanup_free_ char *budget_path = NULL;
+  const char *path = cfg.budget_file;
+  int r;
+
+  if (cfg.request_budget == 0) {
+    return;
+  }
+
+  if (path == NULL) {
+    const char *dir = cfg.cache_dir;
+
+    if (dir == NULL && get_cache_path(cache_path, sizeof(cache_path)) == 0) {
+      dir = cache_path;
+    }
+    if (dir == NULL || asprintf(&budget_path, "%s/budget", dir) < 0) {
+      budget_path = NULL;
+      cwr_fprintf(stderr, LOG_WARN, "nowhere to keep the request budget\n");
+      return;
+    }
+    path = budget_path;
+  }
+
+  r = budget_open(path, cfg.request_budget, &budget);
+  if (r < 0) {
+    cwr_fprintf(stderr, LOG_WARN, "failed to open request budget %s: %s\n", path, strerror(-r));
+    return;
+  }
+
+  cwr_printf(LOG_DEBUG, "sharing a budget of %ld requests a day through %s\n",
+      cfg.request_budget, path);
+}
+
+int open_store(void) {
+  char cache_path[PATH_MAX];
+  const char *dir = cfg.cache_dir;
+  long size = cfg.cache_size;
+  int r;
+
+  /* the store writes to disk on every download, so it's only on by default
+   * for those who've said where it should go or who need it to be there */
+  if (size < 0) {
+    size = dir != NULL || cfg.offline ? kDefaultCacheSize : 0;
+  }
+
+  if (size == 0) {
+    if (cfg.offline) {
+      cwr_fprintf(stderr, LOG_ERROR, "--offline needs the snapshot store, but CacheSize is 0\n");
+      return 1;
+    }
+    return 0;
+  }
+
+  if (dir == NULL) {
+    if (get_cache_path(cache_path, sizeof(cache_path)) != 0) {
+      return cfg.offline;
+    }
+    dir = cache_path;
+  }
+
+  r = store_open(dir, (off_t)size * 1024 * 1024, &store);
+  if (r < 0) {
+    /* without the store, we can still download, just not reuse anything */
+    cwr_fprintf(stderr, cfg.offline ? LOG_ERROR : LOG_WARN,
+        "failed to open snapshot store in %s: %s\n", dir, strerror(-r));
+    return cfg.offline;
+  }
+
+  cwr_printf(LOG_DEBUG, "using snapshot store in %s\n", dir);
+
+  return 0;
+}
+
+/* Remember which snapshot package was last found in, for --offline. */
+void remember_package(const aurpkg_t *package) {
+  struct store_ref_t ref = {
+    .pkgbase = package->pkgbase,
+    .version = package->version,
+    .lastmodified = package->modified_s,
+  };
+
+  if (store_name_set(store, package->name, &ref) < 0) {
+    cwr_printf(LOG_DEBUG, "[%s]: failed to remember snapshot\n", package->name);
+  }
+}
+
+/* Build what we know of a package from the store, in place of an RPC. */
+aurpkg_t *offline_package(const char *name) {
+  struct store_ref_t ref;
+  aurpkg_t *package;
+
+  if (store == NULL || store_name_get(store, name, &ref) < 0) {
+    return NULL;
+  }
+
+  package = calloc(1, sizeof(*package));
+  if (package == NULL) {
+    store_ref_clear(&ref);
+    return NULL;
+  }
+
+  package->name = strdup(name);
+  package->pkgbase = ref.pkgbase;
+  package->version = ref.version;
+  package->modified_s = ref.lastmodified;
+
+  if (package->name == NULL) {
+    aur_package_free(package);
+    return NULL;
+  }
+
+  return package;
+}
+
 void *thread_pool(void *arg) {
   aurpkg_t **packages = NULL;
   struct task_t task = *(struct task_t *)arg;
 
+  task.response = NULL;
+  task.seed = (unsigned int)time(NULL) ^ (unsigned int)task.worker << 16;
+  task.rpcbuf.data = NULL;
+  task.rpcbuf.size = task.rpcbuf.capacity = 0;
+
   task.curl = curl_easy_init();
   if (!task.curl) {
     cwr_fprintf(stderr, LOG_ERROR, "curl: failed to initialize handle\n");
     return NULL;
   }
 
-  while (1) {
-    char *job = NULL;
+  for (;;) {
+    struct job_t *job;
     aurpkg_t **ret;
+    char *name = NULL;
 
-    pthread_mutex_lock(&listlock);
-    if (workq) {
-      job = workq->data;
-      workq = workq->next;
+    job = workq_pop(workq, task.worker);
+    if (job == NULL) {
+      break;
     }
-    pthread_mutex_unlock(&listlock);
 
-    if (!job) {
-      break;
+    task.timed_out = 0;
+    if (job->frontier != NULL) {
+      resolve_frontier(job->frontier, &task);
+      alpm_list_free(job->frontier);
+      ret = NULL;
+    } else if (job->package != NULL) {
+      /* the job frees the package */
+      if (cfg.deadline > 0) {
+        name = strdup(job->package->name);
+      }
+      ret = task_download_package(&task, job->package);
+    } else {
+      ret = (job->fn ? job->fn : task.threadfn)(&task, job->target);
     }
 
-    ret = task.threadfn(&task, job);
-    if (ret != NULL) {
+    if (task.timed_out && (name != NULL || job->target != NULL)) {
+      report_unresolved(name ? name : job->target);
+    }
+    free(name);
+
+    if (job->dependency) {
+      aur_packages_free(ret);
+    } else if (ret != NULL) {
       int r;
 
+      if (stream.printfn != NULL) {
+        stream_results(ret);
+      }
+
       r = aur_packages_append(&packages, ret);
       if (r < 0) {
         cwr_fprintf(stderr, LOG_ERROR, "failed to append task return to package list: %s\n",
             strerror(-r));
       }
     }
+
+    free(job);
+    resolver_job_done(&task);
+    workq_done(workq);
   }
 
   curl_easy_cleanup(task.curl);
+  free(task.rpcbuf.data);
 
   return packages;
 }
@@ -2042,11 +4867,18 @@ void usage(void) {
                                      "with the -d flag\n\n");
   fprintf(stderr, " General options:\n"
       "      --by <search-by>      search by one of 'name', 'name-desc', or 'maintainer'\n"
-      "      --domain <fqdn>       point cower at a different AUR (default: aur.archlinux.org)\n"
+      "      --cachedir <dir>      store downloaded snapshots in dir\n"
+      "      --domain <fqdn>       point cower at a different AUR, or repeat to add mirrors\n"
+      "      --extract-jobs <num>  limit number of threads extracting downloads\n"
       "  -f, --force               overwrite existing files when downloading\n"
       "  -h, --help                display this help and exit\n"
       "      --ignore <pkg>        ignore a package upgrade (can be used more than once)\n"
       "      --ignorerepo[=repo]   ignore some or all binary repos\n"
+      "      --deadline <secs>     give up on requests still unfinished after secs\n"
+      "      --hedge               race a second request against slow ones\n"
+      "      --max-rate <rate>     cap the combined download rate in bytes per second\n"
+      "      --offline             download only from the snapshot store\n"
+      "      --retries <num>       retry failed requests up to num times\n"
       "  -t, --target <dir>        specify an alternate download directory\n"
       "      --threads <num>       limit number of threads created\n"
       "      --timeout <num>       specify connection timeout in seconds\n"
@@ -2056,6 +4888,8 @@ void usage(void) {
       "      --debug               show debug output\n"
       "      --format <string>     print package output according to format string\n"
       "  -o, --ignore-ood          skip displaying out of date packages\n"
+      "      --json                print package output as a JSON array\n"
+      "      --ndjson              print package output as one JSON object per line\n"
       "      --no-ignore-ood       the opposite of --ignore-ood\n"
       "      --sort <key>          sort results in ascending order by key\n"
       "      --rsort <key>         sort results in descending order by key\n"
@@ -2077,60 +4911,130 @@ void version(void) {
         "             Cower....\n\n", stdout);
 }
 
-int read_targets_from_file(FILE *in, alpm_list_t **targets) {
-  char line[BUFSIZ];
-  int i = 0, c = 0, end = 0;
-  while (!end) {
-    c = fgetc(in);
+/* Schedule every target read from fd, recording each new one in cfg.targets
+ * so that results can be filtered against it. Returns how many there were. */
+int read_targets_from_file(int fd) {
+  char buf[BUFSIZ * 8];
+  size_t len = 0;
+  int eof = 0, count = 0;
+
+  while (!eof) {
+    const char *p, *end, *token;
+    ssize_t n;
 
-    if (c == EOF) {
-      end = 1;
+    n = read(fd, buf + len, sizeof(buf) - len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      cwr_fprintf(stderr, LOG_ERROR, "failed to read targets: %s\n", strerror(errno));
+      return -errno;
+    } else if (n == 0) {
+      eof = 1;
     }
 
-    if (end || isspace(c)) {
-      line[i] = '\0';
-      /* avoid adding zero length arg, if multiple spaces separate args */
-      if (i > 0) {
-        if (!alpm_list_find_str(*targets, line)) {
-          cwr_printf(LOG_DEBUG, "adding target: %s\n", line);
-          *targets = alpm_list_add(*targets, strdup(line));
-        }
-        i = 0;
+    end = buf + len + n;
+    for (p = buf;; ) {
+      while (p < end && isspace((unsigned char)*p)) {
+        p++;
       }
-    } else {
-      line[i] = c;
-      ++i;
-      if (i >= BUFSIZ) {
-        cwr_fprintf(stderr, LOG_ERROR, "buffer overflow detected in stdin\n");
-        return -1;
+
+      token = p;
+      while (p < end && !isspace((unsigned char)*p)) {
+        p++;
+      }
+
+      /* the last token may continue in the next read */
+      if (p == end && !eof) {
+        break;
+      }
+
+      if (p == token) {
+        break;
+      }
+
+      if (schedule_target(token, p - token) > 0) {
+        cfg.targets = alpm_list_add(cfg.targets, strndup(token, p - token));
+        count++;
       }
     }
+
+    len = end - token;
+    if (len == sizeof(buf)) {
+      cwr_fprintf(stderr, LOG_ERROR, "buffer overflow detected in stdin\n");
+      return -ENOBUFS;
+    }
+    memmove(buf, token, len);
   }
 
-  return 0;
+  return count;
 }
 
-aurpkg_t **cower_perform(struct task_t *task, int num_threads) {
+aurpkg_t **cower_perform(struct task_t *task, int num_threads, int (*feedfn)(void), int *feedret) {
   aurpkg_t **results = NULL;
   _cleanup_free_ pthread_t *threads = NULL;
-  int i;
+  _cleanup_free_ struct task_t *tasks = NULL;
+  _cleanup_free_ pthread_t *extractors = NULL;
+  _cleanup_free_ int *extractor_ids = NULL;
+  int i, num_extractors = 0;
 
   threads = malloc(num_threads * sizeof(*threads));
-  if (threads == NULL) {
+  tasks = malloc(num_threads * sizeof(*tasks));
+  if (threads == NULL || tasks == NULL) {
     return NULL;
   }
 
+  /* the extraction stage runs alongside the network workers, so disk writes
+   * never hold up a connection */
+  if (extractq != NULL) {
+    extractors = malloc(cfg.extract_jobs * sizeof(*extractors));
+    extractor_ids = malloc(cfg.extract_jobs * sizeof(*extractor_ids));
+    if (extractors == NULL || extractor_ids == NULL) {
+      return NULL;
+    }
+
+    for (num_extractors = 0; num_extractors < cfg.extract_jobs; num_extractors++) {
+      int r;
+
+      extractor_ids[num_extractors] = num_extractors;
+      r = pthread_create(&extractors[num_extractors], NULL, extract_pool,
+          &extractor_ids[num_extractors]);
+      if (r != 0) {
+        cwr_fprintf(stderr, LOG_ERROR, "failed to spawn new thread: %s\n", strerror(r));
+        break;
+      }
+    }
+
+    /* without anyone to extract, the network workers will do it themselves */
+    if (num_extractors == 0) {
+      workq_free(extractq);
+      extractq = NULL;
+    }
+  }
+
   for (i = 0; i < num_threads; i++) {
     int r;
 
-    r = pthread_create(&threads[i], NULL, thread_pool, task);
+    tasks[i] = *task;
+    tasks[i].worker = i;
+
+    r = pthread_create(&threads[i], NULL, thread_pool, &tasks[i]);
     if (r != 0) {
       cwr_fprintf(stderr, LOG_ERROR, "failed to spawn new thread: %s\n",
           strerror(r));
-      return NULL;
+      break;
     }
   }
 
+  num_threads = i;
+
+  /* the workers are running, so anything fed from here on is picked up as
+   * soon as it is queued. */
+  if (feedfn != NULL && num_threads > 0) {
+    *feedret = feedfn();
+  }
+  workq_close(workq);
+
   for (i = 0; i < num_threads; i++) {
     aurpkg_t **thread_return;
 
@@ -2146,13 +5050,36 @@ aurpkg_t **cower_perform(struct task_t *task, int num_threads) {
     }
   }
 
+  /* the network workers only leave once every extraction has finished */
+  if (extractq != NULL) {
+    workq_close(extractq);
+    for (i = 0; i < num_extractors; i++) {
+      pthread_join(extractors[i], NULL);
+    }
+  }
+
+  if (downloaded.packages != NULL) {
+    int r;
+
+    r = aur_packages_append(&results, downloaded.packages);
+    if (r < 0) {
+      cwr_fprintf(stderr, LOG_ERROR,
+          "failed to append downloads to package list: %s\n", strerror(-r));
+      aur_packages_free(downloaded.packages);
+    }
+    downloaded.packages = NULL;
+  }
+
   return filter_results(results);
 }
 
 int main(int argc, char *argv[]) {
   int num_threads, ret;
   aurpkg_t **results;
+  const alpm_list_t *t;
   void (*printfn)(aurpkg_t*) = NULL;
+  int (*feedfn)(void) = NULL;
+  int feedret = 0;
   struct task_t task;
 
   setlocale(LC_ALL, "");
@@ -2162,6 +5089,10 @@ int main(int argc, char *argv[]) {
    * reset to the user's chosen LC_NUMERIC locale. */
   setlocale(LC_NUMERIC, "C");
 
+  /* A reader that goes away early, like `cower -sq foo | head -1`, should
+   * show up as EPIPE from output_flush rather than kill us mid-run. */
+  signal(SIGPIPE, SIG_IGN);
+
   ret = parse_configfile();
   if (ret != 0) {
     return ret;
@@ -2172,27 +5103,81 @@ int main(int argc, char *argv[]) {
     return ret;
   }
 
-  ret = aur_new("https", cfg.aur_domain, &task.aur);
+  if (cfg.deadline > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline_at);
+    deadline_at.tv_sec += cfg.deadline;
+  }
+
+  ret = aur_new("https", cfg.domains ? cfg.domains->data : cfg.aur_domain, &task.aur);
   if (ret < 0) {
     fprintf(stderr, "error: aur_new failed: %s\n", strerror(-ret));
     return 1;
   }
 
+  for (t = cfg.domains ? cfg.domains->next : NULL; t; t = t->next) {
+    ret = aur_add_endpoint(task.aur, "https", t->data);
+    if (ret < 0) {
+      fprintf(stderr, "error: failed to add endpoint %s: %s\n",
+          (const char *)t->data, strerror(-ret));
+      return 1;
+    }
+  }
+
+  /* mirrors and proxies given as bare domains are presumed to serve the
+   * same pages. failing that, links go to the real thing. */
+  for (t = cfg.domains; t; t = t->next) {
+    if (strstr(t->data, "://") == NULL) {
+      cfg.aur_domain = t->data;
+      break;
+    }
+  }
+
+  ret = strset_new(&scheduled);
+  if (ret < 0) {
+    fprintf(stderr, "error: failed to initialize target set: %s\n", strerror(-ret));
+    ret = 1;
+    goto finish;
+  }
+
+  ret = pkgcache_new(&infocache);
+  if (ret < 0) {
+    fprintf(stderr, "error: failed to initialize package cache: %s\n", strerror(-ret));
+    ret = 1;
+    goto finish;
+  }
+
+  ret = flight_new(&snapshots, NULL);
+  if (ret < 0) {
+    fprintf(stderr, "error: failed to initialize snapshot registry: %s\n", strerror(-ret));
+    ret = 1;
+    goto finish;
+  }
+
+  if ((cfg.opmask & OP_DOWNLOAD) && open_store() != 0) {
+    ret = 1;
+    goto finish;
+  }
+
+  open_budget();
+
+  if (cfg.max_rate > 0) {
+    ret = throttle_new(cfg.max_rate, &throttle);
+    if (ret < 0) {
+      fprintf(stderr, "error: failed to initialize rate limit: %s\n", strerror(-ret));
+      ret = 1;
+      goto finish;
+    }
+    cwr_printf(LOG_DEBUG, "capping downloads at %ld bytes per second\n", cfg.max_rate);
+  }
+
   if (cfg.frompkgbuild) {
     /* treat arguments as filenames to load/extract */
-    cfg.targets = load_targets_from_files(cfg.targets);
+    feedfn = feed_targets_from_files;
   } else if (alpm_list_find_str(cfg.targets, "-")) {
     char *vdata;
     cfg.targets = alpm_list_remove_str(cfg.targets, "-", &vdata);
     free(vdata);
-    cwr_printf(LOG_DEBUG, "reading targets from stdin\n");
-    ret = read_targets_from_file(stdin, &cfg.targets);
-    if (ret != 0) {
-      goto finish;
-    }
-    if (!freopen(ctermid(NULL), "r", stdin)) {
-      cwr_printf(LOG_DEBUG, "failed to reopen stdin for reading\n");
-    }
+    feedfn = feed_targets_from_stdin;
   }
 
   pmhandle = alpm_init();
@@ -2202,7 +5187,7 @@ int main(int argc, char *argv[]) {
   }
 
   /* allow specific updates to be provided instead of examining all foreign pkgs */
-  if ((cfg.opmask & OP_UPDATE) && !cfg.targets) {
+  if ((cfg.opmask & OP_UPDATE) && !cfg.targets && !feedfn) {
     cfg.targets = alpm_find_foreign_pkgs();
     if (cfg.targets == NULL) {
       /* no foreign packages found, just exit */
@@ -2215,43 +5200,151 @@ int main(int argc, char *argv[]) {
     task.threadfn = task_update;
   } else if (cfg.opmask & OP_INFO) {
     task.threadfn = task_query;
-    printfn = cfg.format ? print_pkg_formatted : print_pkg_info;
+    printfn = cfg.json ? print_pkg_json : cfg.format ? print_pkg_formatted : print_pkg_info;
   } else if (cfg.opmask & OP_SEARCH) {
     task.threadfn = task_query;
-    printfn = cfg.format ? print_pkg_formatted : print_pkg_search;
+    printfn = cfg.json ? print_pkg_json : cfg.format ? print_pkg_formatted : print_pkg_search;
   } else if (cfg.opmask & OP_DOWNLOAD) {
     task.threadfn = task_download;
   }
 
-  workq = cfg.targets;
+  if (printfn == print_pkg_formatted && format_compile(cfg.format, cfg.delim) < 0) {
+    fprintf(stderr, "error: failed to compile format string\n");
+    ret = 1;
+    goto finish;
+  }
+
+  if (printfn != NULL) {
+    ret = output_new(STDOUT_FILENO, kOutputBufferSize, &output);
+    if (ret < 0) {
+      fprintf(stderr, "error: failed to set up output: %s\n", strerror(-ret));
+      ret = 1;
+      goto finish;
+    }
+  }
+
+  if (printfn == print_pkg_json && json_open() < 0) {
+    fprintf(stderr, "error: failed to set up JSON output\n");
+    ret = 1;
+    goto finish;
+  }
 
-  num_threads = alpm_list_count(cfg.targets);
-  if (num_threads == 0) {
+  /* unless asked to sort them, terse results are printed as they arrive
+   * instead of waiting on the slowest request. search patterns read from
+   * stdin aren't all known until the end, so those results have to wait. */
+  if (printfn != NULL && !cfg.sorted && (cfg.quiet || cfg.format || cfg.json) &&
+      !(feedfn == feed_targets_from_stdin && allow_regex())) {
+    ret = stream_open(printfn);
+    if (ret < 0) {
+      fprintf(stderr, "error: failed to set up output: %s\n", strerror(-ret));
+      ret = 1;
+      goto finish;
+    }
+  }
+
+  if (cfg.targets == NULL && feedfn == NULL) {
     fprintf(stderr, "error: no targets specified (use -h for help)\n");
     goto finish;
-  } else if (num_threads > cfg.maxthreads) {
+  }
+
+  /* fed targets are of unknown number, and so are dependencies. how many of
+   * the threads get to make requests at once is up to the limiter. */
+  num_threads = feedfn || cfg.getdeps ? cfg.maxthreads : (int)alpm_list_count(cfg.targets);
+  if (num_threads > cfg.maxthreads) {
     num_threads = cfg.maxthreads;
   }
 
-  results = cower_perform(&task, num_threads);
+  ret = limiter_new(kInitialConcurrency, num_threads, &limiter);
+  if (ret < 0) {
+    fprintf(stderr, "error: failed to initialize limiter: %s\n", strerror(-ret));
+    ret = 1;
+    goto finish;
+  }
+  cwr_printf(LOG_DEBUG, "concurrency limit starts at %d, up to %d\n",
+      limiter_limit(limiter), num_threads);
+
+  ret = workq_new(&workq, num_threads);
+  if (ret < 0) {
+    fprintf(stderr, "error: failed to initialize work queue: %s\n", strerror(-ret));
+    ret = 1;
+    goto finish;
+  }
+
+  if (cfg.opmask & OP_DOWNLOAD) {
+    if (cfg.extract_jobs == 0) {
+      /* extraction is mostly disk bound, so a few threads go a long way */
+      long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+      cfg.extract_jobs = ncpus < 1 ? 1 : ncpus > 4 ? 4 : (int)ncpus;
+    }
+
+    ret = workq_new(&extractq, cfg.extract_jobs);
+    if (ret < 0) {
+      fprintf(stderr, "error: failed to initialize work queue: %s\n", strerror(-ret));
+      ret = 1;
+      goto finish;
+    }
+
+    /* when the disk can't keep up, make the network workers wait rather than
+     * pile up tarballs in memory */
+    workq_limit(extractq, (long)cfg.extract_jobs * kExtractBacklog);
+  }
+
+  if (!cfg.frompkgbuild) {
+    for (t = cfg.targets; t; t = t->next) {
+      schedule_target(t->data, strlen(t->data));
+    }
+  }
+
+  results = cower_perform(&task, num_threads, feedfn, &feedret);
 
   /* we need to exit with a non-zero value when:
    * a) search/info/download returns nothing
    * b) update (without download) returns something
    * this is opposing behavior, so just XOR the result on a pure update */
   ret = (!have_unignored_results(results) ^ !(cfg.opmask & ~OP_UPDATE));
+  if (feedret < 0) {
+    ret = 1;
+  }
+
+  /* Restore the user-defined LC_NUMERIC locale before printing results. JSON
+   * has to stay in the C locale's. */
+  if (!cfg.json) {
+    setlocale(LC_NUMERIC, "");
+  }
+  if (stream.printfn == NULL) {
+    print_results(results, printfn);
+  }
 
-  /* Restore the user-defined LC_NUMERIC locale before printing results. */
-  setlocale(LC_NUMERIC, "");
-  print_results(results, printfn);
+  /* whatever finished in time has been printed, so at least say what didn't */
+  if (unresolved.targets != NULL) {
+    unresolved.targets = alpm_list_msort(unresolved.targets,
+        alpm_list_count(unresolved.targets), (alpm_list_fn_cmp)strcmp);
+    cwr_fprintf(stderr, LOG_ERROR, "deadline of %lds expired before finishing:",
+        cfg.deadline);
+    if (cfg.logmask & LOG_ERROR) {
+      for (t = unresolved.targets; t; t = t->next) {
+        fprintf(stderr, " %s", (const char *)t->data);
+      }
+      fputc('\n', stderr);
+    }
+    ret = 4;
+  }
 
   aur_packages_free(results);
 
 finish:
   free(cfg.working_dir);
+  free(cfg.cache_dir);
+  free(cfg.budget_file);
   FREELIST(cfg.targets);
   FREELIST(cfg.ignore.pkgs);
   FREELIST(cfg.ignore.repos);
+  FREELIST(unresolved.targets);
+  FREELIST(cfg.domains);
+  format_free();
+  stream_close();
+  json_close();
+  output_free(output);
 
   cwr_printf(LOG_DEBUG, "releasing curl\n");
 
@@ -2260,5 +5353,15 @@ finish:
   cwr_printf(LOG_DEBUG, "releasing alpm\n");
   alpm_release(pmhandle);
 
+  workq_free(workq);
+  workq_free(extractq);
+  strset_free(scheduled);
+  pkgcache_free(infocache);
+  limiter_free(limiter);
+  budget_close(budget);
+  throttle_free(throttle);
+  flight_free(snapshots);
+  store_close(store);
+
   return ret;
 }
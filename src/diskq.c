@@ -0,0 +1,522 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "diskq.h"
+#include "fs.h"
+
+/* files per batch, which is also the depth of the ring. A batch never needs
+ * more than one submission queue entry per file at a time. */
+#define DISKQ_DEPTH 64
+
+/* flush early once this much data is queued, to bound memory use */
+#define DISKQ_MAX_BYTES (8 << 20)
+
+struct diskq_file_t {
+  char *path;
+  char *data;
+  size_t size;
+  mode_t mode;
+  struct timespec times[2];
+  int fd;
+  int res;
+};
+
+struct diskq_t {
+  int ringfd;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* entries prepared but not yet handed to the kernel */
+  unsigned sq_pending;
+
+  /* a run failed partway, so completions for it may still turn up. the ring
+   * is left alone from then on, and files are written synchronously. */
+  int broken;
+
+  struct diskq_file_t files[DISKQ_DEPTH];
+  size_t nfiles;
+  size_t bytes;
+};
+
+static pthread_once_t umask_once = PTHREAD_ONCE_INIT;
+static mode_t process_umask = 0777;
+
+/* umask(2) can only be read by changing it, which would race with any other
+ * thread creating files, so ask the kernel instead. */
+static void read_umask(void) {
+  char line[128];
+  FILE *fp;
+
+  fp = fopen("/proc/self/status", "re");
+  if (fp == NULL) {
+    return;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    unsigned int mask;
+
+    if (sscanf(line, "Umask: %o", &mask) == 1) {
+      process_umask = mask & 0777;
+      break;
+    }
+  }
+
+  fclose(fp);
+}
+
+int diskq_mode_ok(mode_t mode) {
+  pthread_once(&umask_once, read_umask);
+
+  return (mode & ~0777) == 0 && (mode & process_umask) == 0;
+}
+
+static int ring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ring_enter(int fd, unsigned to_submit, unsigned min_complete) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+      IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static int ring_supports(int fd, const int *ops, size_t nops) {
+  struct io_uring_probe *probe;
+  size_t i;
+  int r = 0;
+
+  probe = calloc(1, sizeof(*probe) + IORING_OP_LAST * sizeof(probe->ops[0]));
+  if (probe == NULL) {
+    return -ENOMEM;
+  }
+
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) {
+    r = -errno;
+    goto finish;
+  }
+
+  for (i = 0; i < nops; ++i) {
+    if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+      r = -EOPNOTSUPP;
+      break;
+    }
+  }
+
+finish:
+  free(probe);
+
+  return r;
+}
+
+int diskq_new(diskq_t **q) {
+  static const int ops[] = { IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE };
+  struct io_uring_params p;
+  diskq_t *d;
+  int r;
+
+  d = calloc(1, sizeof(*d));
+  if (d == NULL) {
+    return -ENOMEM;
+  }
+
+  memset(&p, 0, sizeof(p));
+  d->ringfd = ring_setup(DISKQ_DEPTH, &p);
+  if (d->ringfd < 0) {
+    r = -errno;
+    free(d);
+    return r;
+  }
+
+  r = ring_supports(d->ringfd, ops, sizeof(ops) / sizeof(ops[0]));
+  if (r < 0) {
+    goto fail;
+  }
+
+  d->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  d->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (d->cq_ring_size > d->sq_ring_size) {
+      d->sq_ring_size = d->cq_ring_size;
+    }
+    d->cq_ring_size = 0;
+  }
+
+  d->sq_ring = mmap(NULL, d->sq_ring_size, PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE, d->ringfd, IORING_OFF_SQ_RING);
+  if (d->sq_ring == MAP_FAILED) {
+    d->sq_ring = NULL;
+    r = -errno;
+    goto fail;
+  }
+
+  if (d->cq_ring_size > 0) {
+    d->cq_ring = mmap(NULL, d->cq_ring_size, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, d->ringfd, IORING_OFF_CQ_RING);
+    if (d->cq_ring == MAP_FAILED) {
+      d->cq_ring = NULL;
+      r = -errno;
+      goto fail;
+    }
+  } else {
+    d->cq_ring = d->sq_ring;
+  }
+
+  d->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  d->sqes = mmap(NULL, d->sqes_size, PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE, d->ringfd, IORING_OFF_SQES);
+  if (d->sqes == MAP_FAILED) {
+    d->sqes = NULL;
+    r = -errno;
+    goto fail;
+  }
+
+  d->sq_head = (unsigned *)((char *)d->sq_ring + p.sq_off.head);
+  d->sq_tail = (unsigned *)((char *)d->sq_ring + p.sq_off.tail);
+  d->sq_mask = (unsigned *)((char *)d->sq_ring + p.sq_off.ring_mask);
+  d->sq_array = (unsigned *)((char *)d->sq_ring + p.sq_off.array);
+  d->cq_head = (unsigned *)((char *)d->cq_ring + p.cq_off.head);
+  d->cq_tail = (unsigned *)((char *)d->cq_ring + p.cq_off.tail);
+  d->cq_mask = (unsigned *)((char *)d->cq_ring + p.cq_off.ring_mask);
+  d->cqes = (struct io_uring_cqe *)((char *)d->cq_ring + p.cq_off.cqes);
+
+  *q = d;
+  return 0;
+
+fail:
+  diskq_free(d);
+
+  return r;
+}
+
+static void file_clear(struct diskq_file_t *f) {
+  free(f->path);
+  free(f->data);
+  memset(f, 0, sizeof(*f));
+}
+
+void diskq_free(diskq_t *q) {
+  size_t i;
+
+  if (q == NULL) {
+    return;
+  }
+
+  for (i = 0; i < q->nfiles; ++i) {
+    file_clear(&q->files[i]);
+  }
+
+  if (q->sqes) {
+    munmap(q->sqes, q->sqes_size);
+  }
+  if (q->cq_ring && q->cq_ring != q->sq_ring) {
+    munmap(q->cq_ring, q->cq_ring_size);
+  }
+  if (q->sq_ring) {
+    munmap(q->sq_ring, q->sq_ring_size);
+  }
+
+  close(q->ringfd);
+  free(q);
+}
+
+static struct io_uring_sqe *ring_get_sqe(diskq_t *q, size_t file) {
+  const unsigned tail = *q->sq_tail + q->sq_pending;
+  const unsigned idx = tail & *q->sq_mask;
+  struct io_uring_sqe *sqe = &q->sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = file;
+  q->sq_array[idx] = idx;
+  q->sq_pending++;
+
+  return sqe;
+}
+
+/* Submit everything prepared and wait for all of it to complete. Each
+ * file's res receives the result of its operation. */
+static int ring_run(diskq_t *q) {
+  unsigned to_submit = q->sq_pending, outstanding = q->sq_pending;
+
+  if (outstanding == 0) {
+    return 0;
+  }
+
+  __atomic_store_n(q->sq_tail, *q->sq_tail + q->sq_pending, __ATOMIC_RELEASE);
+  q->sq_pending = 0;
+
+  while (outstanding > 0) {
+    unsigned head, tail;
+    int n;
+
+    n = ring_enter(q->ringfd, to_submit, outstanding);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      q->broken = 1;
+      return -errno;
+    }
+
+    to_submit -= (unsigned)n < to_submit ? (unsigned)n : to_submit;
+
+    head = *q->cq_head;
+    tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const struct io_uring_cqe *cqe = &q->cqes[head & *q->cq_mask];
+
+      q->files[cqe->user_data].res = cqe->res;
+      outstanding--;
+    }
+    __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  return 0;
+}
+
+/* Open, with parents created as needed for tarballs which don't carry
+ * entries for them, and set fd, or set it to -errno. */
+static void open_file(struct diskq_file_t *f, int flags) {
+  f->fd = open(f->path, flags, f->mode);
+  if (f->fd < 0 && errno == ENOENT) {
+    mkdir_parents(f->path);
+    f->fd = open(f->path, flags, f->mode);
+  }
+  if (f->fd < 0) {
+    f->fd = -errno;
+  }
+}
+
+static void close_all(diskq_t *q) {
+  size_t i;
+
+  for (i = 0; i < q->nfiles; ++i) {
+    if (q->files[i].fd >= 0) {
+      close(q->files[i].fd);
+    }
+  }
+}
+
+static int write_all(int fd, const char *data, size_t size, off_t offset) {
+  while ((size_t)offset < size) {
+    ssize_t n = pwrite(fd, data + offset, size - offset, offset);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+
+    offset += n;
+  }
+
+  return 0;
+}
+
+/* The same thing diskq_flush does, one file at a time, for once the ring
+ * can't be trusted. */
+static int flush_sync(diskq_t *q, int flags) {
+  size_t i;
+  int r = 0, k;
+
+  for (i = 0; i < q->nfiles; ++i) {
+    struct diskq_file_t *f = &q->files[i];
+
+    open_file(f, flags);
+    if (f->fd < 0) {
+      if (r == 0) {
+        r = f->fd;
+      }
+      continue;
+    }
+
+    k = write_all(f->fd, f->data, f->size, 0);
+    if (k < 0 && r == 0) {
+      r = k;
+    }
+
+    if (futimens(f->fd, f->times) < 0 && r == 0) {
+      r = -errno;
+    }
+
+    if (close(f->fd) < 0 && r == 0) {
+      r = -errno;
+    }
+  }
+
+  return r;
+}
+
+int diskq_flush(diskq_t *q) {
+  const int flags = O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC;
+  size_t i;
+  int r = 0, k;
+
+  if (q->nfiles == 0) {
+    return 0;
+  }
+
+  if (q->broken) {
+    r = flush_sync(q, flags);
+    goto finish;
+  }
+
+  for (i = 0; i < q->nfiles; ++i) {
+    struct diskq_file_t *f = &q->files[i];
+    struct io_uring_sqe *sqe = ring_get_sqe(q, i);
+
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)f->path;
+    sqe->len = f->mode;
+    sqe->open_flags = flags;
+
+    /* so that an open which never completed isn't mistaken for an fd */
+    f->res = -ECANCELED;
+  }
+
+  k = ring_run(q);
+  if (k < 0) {
+    /* the opens which did complete handed us fds of their own */
+    for (i = 0; i < q->nfiles; ++i) {
+      if (q->files[i].res >= 0) {
+        close(q->files[i].res);
+      }
+    }
+    r = k;
+    goto finish;
+  }
+
+  for (i = 0; i < q->nfiles; ++i) {
+    struct diskq_file_t *f = &q->files[i];
+
+    f->fd = f->res;
+    if (f->fd == -ENOENT) {
+      open_file(f, flags);
+    }
+
+    if (f->fd < 0) {
+      if (r == 0) {
+        r = f->fd;
+      }
+    } else if (f->size > 0) {
+      struct io_uring_sqe *sqe = ring_get_sqe(q, i);
+
+      sqe->opcode = IORING_OP_WRITE;
+      sqe->fd = f->fd;
+      sqe->addr = (unsigned long)f->data;
+      sqe->len = f->size > 1U << 30 ? 1U << 30 : (unsigned)f->size;
+      sqe->off = 0;
+    }
+  }
+
+  k = ring_run(q);
+  if (k < 0) {
+    close_all(q);
+    r = k;
+    goto finish;
+  }
+
+  for (i = 0; i < q->nfiles; ++i) {
+    struct diskq_file_t *f = &q->files[i];
+    struct io_uring_sqe *sqe;
+
+    if (f->fd < 0) {
+      continue;
+    }
+
+    if (f->size > 0) {
+      /* a short write finishes synchronously */
+      k = f->res < 0 ? f->res : write_all(f->fd, f->data, f->size, f->res);
+      if (k < 0 && r == 0) {
+        r = k;
+      }
+    }
+
+    /* io_uring has no way to set timestamps, so these stay synchronous */
+    if (futimens(f->fd, f->times) < 0 && r == 0) {
+      r = -errno;
+    }
+
+    sqe = ring_get_sqe(q, i);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = f->fd;
+  }
+
+  k = ring_run(q);
+  if (k < 0) {
+    close_all(q);
+    if (r == 0) {
+      r = k;
+    }
+    goto finish;
+  }
+
+  /* on network filesystems, close is where a failed write may surface */
+  for (i = 0; i < q->nfiles && r == 0; ++i) {
+    if (q->files[i].fd >= 0 && q->files[i].res < 0) {
+      r = q->files[i].res;
+    }
+  }
+
+finish:
+  for (i = 0; i < q->nfiles; ++i) {
+    file_clear(&q->files[i]);
+  }
+  q->nfiles = 0;
+  q->bytes = 0;
+
+  return r;
+}
+
+int diskq_add(diskq_t *q, const char *path, mode_t mode,
+    const struct timespec times[2], char *data, size_t size) {
+  struct diskq_file_t *f;
+  int r = 0;
+
+  if (q->nfiles == DISKQ_DEPTH || q->bytes + size > DISKQ_MAX_BYTES) {
+    r = diskq_flush(q);
+  }
+
+  f = &q->files[q->nfiles];
+  f->path = strdup(path);
+  if (f->path == NULL) {
+    free(data);
+    return -ENOMEM;
+  }
+
+  f->data = data;
+  f->size = size;
+  f->mode = mode;
+  f->times[0] = times[0];
+  f->times[1] = times[1];
+  f->fd = -1;
+
+  q->nfiles++;
+  q->bytes += size;
+
+  return r;
+}
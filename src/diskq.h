@@ -0,0 +1,35 @@
+#ifndef DISKQ_H
+#define DISKQ_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/* Batches the creation of regular files through io_uring, so that extracting
+ * a tarball costs a handful of syscalls per batch rather than a chain of them
+ * per file. Files are created, written and closed when the batch is flushed,
+ * which happens once it fills up or when asked to. A queue is meant to be kept
+ * around and used for batch after batch, by one thread at a time.
+ *
+ * diskq_new fails with -ENOSYS (or whatever the kernel said) when io_uring
+ * isn't available, in which case callers should write files themselves. */
+typedef struct diskq_t diskq_t;
+
+int diskq_new(diskq_t **q);
+void diskq_free(diskq_t *q);
+
+/* Whether a new file created with mode would come out with exactly those
+ * permissions. The queue can't chmod, so files for which this doesn't hold
+ * must be written some other way. */
+int diskq_mode_ok(mode_t mode);
+
+/* Queue path to be replaced with size bytes of data. The queue takes
+ * ownership of data, which must come from malloc. times are applied as with
+ * utimensat. Returns 0 or a negative errno, which may be from the flush of an
+ * earlier batch. */
+int diskq_add(diskq_t *q, const char *path, mode_t mode,
+    const struct timespec times[2], char *data, size_t size);
+
+/* Write out everything queued. Returns 0, or the first error encountered. */
+int diskq_flush(diskq_t *q);
+
+#endif  /* DISKQ_H */
@@ -0,0 +1,171 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flight.h"
+#include "hash.h"
+
+#define FLIGHT_BUCKETS 1024
+
+struct flight_entry_t {
+  char *key;
+  void *value;
+  int pending;
+  /* the work fell through, and the next caller should try again */
+  int failed;
+  struct flight_entry_t *next;
+};
+
+struct flight_t {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  void (*free_value)(void *);
+  struct flight_entry_t *buckets[FLIGHT_BUCKETS];
+};
+
+static struct flight_entry_t **flight_bucket(flight_t *table, const char *key) {
+  return &table->buckets[hash_string(key, strlen(key)) % FLIGHT_BUCKETS];
+}
+
+static struct flight_entry_t *flight_find(flight_t *table, const char *key) {
+  struct flight_entry_t *e;
+
+  for (e = *flight_bucket(table, key); e; e = e->next) {
+    if (strcmp(e->key, key) == 0) {
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+int flight_new(flight_t **table, void (*free_value)(void *)) {
+  flight_t *t;
+
+  t = calloc(1, sizeof(*t));
+  if (t == NULL) {
+    return -ENOMEM;
+  }
+
+  pthread_mutex_init(&t->lock, NULL);
+  pthread_cond_init(&t->cond, NULL);
+  t->free_value = free_value;
+
+  *table = t;
+  return 0;
+}
+
+void flight_free(flight_t *table) {
+  size_t i;
+
+  if (table == NULL) {
+    return;
+  }
+
+  for (i = 0; i < FLIGHT_BUCKETS; ++i) {
+    struct flight_entry_t *e, *next;
+
+    for (e = table->buckets[i]; e; e = next) {
+      next = e->next;
+      if (table->free_value != NULL && e->value != NULL) {
+        table->free_value(e->value);
+      }
+      free(e->key);
+      free(e);
+    }
+  }
+
+  pthread_cond_destroy(&table->cond);
+  pthread_mutex_destroy(&table->lock);
+  free(table);
+}
+
+int flight_get(flight_t *table, const char *key, int wait, void **value) {
+  struct flight_entry_t *e;
+  int r = FLIGHT_HIT;
+
+  *value = NULL;
+
+  pthread_mutex_lock(&table->lock);
+
+  e = flight_find(table, key);
+  if (e == NULL) {
+    struct flight_entry_t **bucket = flight_bucket(table, key);
+
+    e = calloc(1, sizeof(*e));
+    if (e != NULL && (e->key = strdup(key)) != NULL) {
+      e->pending = 1;
+      e->next = *bucket;
+      *bucket = e;
+    } else {
+      free(e);
+    }
+
+    r = FLIGHT_MISS;
+    goto finish;
+  }
+
+  for (;;) {
+    if (e->failed) {
+      e->failed = 0;
+      e->pending = 1;
+      r = FLIGHT_MISS;
+      goto finish;
+    }
+
+    if (!e->pending) {
+      break;
+    }
+
+    if (!wait) {
+      r = FLIGHT_BUSY;
+      goto finish;
+    }
+
+    pthread_cond_wait(&table->cond, &table->lock);
+  }
+
+  *value = e->value;
+
+finish:
+  pthread_mutex_unlock(&table->lock);
+
+  return r;
+}
+
+void flight_put(flight_t *table, const char *key, void *value) {
+  struct flight_entry_t *e;
+
+  pthread_mutex_lock(&table->lock);
+
+  e = flight_find(table, key);
+  if (e != NULL && e->pending) {
+    e->value = value;
+    e->pending = 0;
+    pthread_cond_broadcast(&table->cond);
+    value = NULL;
+  }
+
+  pthread_mutex_unlock(&table->lock);
+
+  /* nobody was holding the claim, so there's nowhere to keep it */
+  if (value != NULL && table->free_value != NULL) {
+    table->free_value(value);
+  }
+}
+
+void flight_abandon(flight_t *table, const char *key) {
+  struct flight_entry_t *e;
+
+  pthread_mutex_lock(&table->lock);
+
+  e = flight_find(table, key);
+  if (e != NULL && e->pending) {
+    e->pending = 0;
+    e->failed = 1;
+    pthread_cond_broadcast(&table->cond);
+  }
+
+  pthread_mutex_unlock(&table->lock);
+}
@@ -0,0 +1,36 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+/* A table of work done at most once per key during this run. Lookups are
+ * single flight: the first caller to miss on a key is responsible for doing
+ * the work, and anyone else asking for that key in the meantime waits for the
+ * outcome rather than doing it again. Outcomes are kept, unchanged, until the
+ * table is freed. */
+typedef struct flight_t flight_t;
+
+enum {
+  FLIGHT_HIT = 0,
+  FLIGHT_MISS,
+  FLIGHT_BUSY,
+};
+
+/* free_value, if not NULL, releases the values handed to flight_put. */
+int flight_new(flight_t **table, void (*free_value)(void *));
+void flight_free(flight_t *table);
+
+/* On FLIGHT_HIT, *value is whatever was recorded for key, still owned by the
+ * table. On FLIGHT_MISS, the caller now owns key and must report back with
+ * flight_put or flight_abandon. Should the claim itself not fit in memory,
+ * FLIGHT_MISS is returned all the same, and the caller does the work
+ * unshared. If wait is zero, FLIGHT_BUSY is returned instead of blocking on
+ * another caller. */
+int flight_get(flight_t *table, const char *key, int wait, void **value);
+
+/* Record the outcome for key, which the table takes ownership of. */
+void flight_put(flight_t *table, const char *key, void *value);
+
+/* Give up a claim on key without an outcome, so that the next caller, or one
+ * already waiting, takes it on instead. */
+void flight_abandon(flight_t *table, const char *key);
+
+#endif  /* FLIGHT_H */
@@ -0,0 +1,28 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "fs.h"
+
+int mkdir_parents(const char *path) {
+  char *dir, *p;
+  int r = 0;
+
+  dir = strdup(path);
+  if (dir == NULL) {
+    return -ENOMEM;
+  }
+
+  for (p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+      r = -errno;
+      break;
+    }
+    *p = '/';
+  }
+
+  free(dir);
+  return r;
+}
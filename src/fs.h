@@ -0,0 +1,10 @@
+#ifndef FS_H
+#define FS_H
+
+/* Create every directory leading up to the last component of path, as
+ * mkdir -p would, so that a file can be created there. A path ending in a
+ * slash has its last directory created as well. Returns 0 or a negative
+ * errno. */
+int mkdir_parents(const char *path);
+
+#endif  /* FS_H */
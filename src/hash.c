@@ -0,0 +1,13 @@
+#include "hash.h"
+
+uint64_t hash_string(const char *str, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  size_t i;
+
+  for (i = 0; i < len; ++i) {
+    hash ^= (unsigned char)str[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
@@ -0,0 +1,11 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 64-bit FNV-1a of len bytes at str. Not for anything adversarial, but cheap
+ * and plenty for tables keyed by package names. */
+uint64_t hash_string(const char *str, size_t len);
+
+#endif  /* HASH_H */
@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "limiter.h"
+
+/* latency this many times the baseline means requests are queueing */
+#define LIMITER_TOLERANCE 2
+
+struct limiter_t {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  /* fractional, so that growth of one per round trip can be spread across
+   * the requests in it */
+  double limit;
+  int max;
+  int inflight;
+  int slowstart;
+
+  /* lowest recent latency, in microseconds */
+  uint64_t baseline;
+
+  /* when the limit was last cut. requests which started before then were
+   * sent under the old limit, and shouldn't cut it again. */
+  uint64_t last_cut;
+};
+
+static uint64_t now_usec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int limiter_new(int initial, int max, limiter_t **limiter) {
+  limiter_t *l;
+
+  l = calloc(1, sizeof(*l));
+  if (l == NULL) {
+    return -ENOMEM;
+  }
+
+  pthread_mutex_init(&l->lock, NULL);
+  pthread_cond_init(&l->cond, NULL);
+  l->max = max > 0 ? max : 1;
+  l->limit = initial < 1 ? 1 : initial > l->max ? l->max : initial;
+  l->slowstart = 1;
+
+  *limiter = l;
+  return 0;
+}
+
+void limiter_free(limiter_t *limiter) {
+  if (limiter == NULL) {
+    return;
+  }
+
+  pthread_cond_destroy(&limiter->cond);
+  pthread_mutex_destroy(&limiter->lock);
+  free(limiter);
+}
+
+uint64_t limiter_acquire(limiter_t *limiter) {
+  uint64_t token;
+
+  pthread_mutex_lock(&limiter->lock);
+  while (limiter->inflight >= (int)limiter->limit) {
+    pthread_cond_wait(&limiter->cond, &limiter->lock);
+  }
+  limiter->inflight++;
+  token = now_usec();
+  pthread_mutex_unlock(&limiter->lock);
+
+  return token;
+}
+
+int limiter_try_acquire(limiter_t *limiter, uint64_t *token) {
+  int r = 0;
+
+  pthread_mutex_lock(&limiter->lock);
+  if (limiter->inflight < (int)limiter->limit) {
+    limiter->inflight++;
+    *token = now_usec();
+    r = 1;
+  }
+  pthread_mutex_unlock(&limiter->lock);
+
+  return r;
+}
+
+static void limiter_cut(limiter_t *limiter, uint64_t token, double factor) {
+  if (token < limiter->last_cut) {
+    return;
+  }
+
+  limiter->limit *= factor;
+  if (limiter->limit < 1) {
+    limiter->limit = 1;
+  }
+  limiter->slowstart = 0;
+  limiter->last_cut = now_usec();
+}
+
+int limiter_release(limiter_t *limiter, uint64_t token, limiter_outcome outcome,
+    uint64_t latency) {
+  int before, after;
+
+  pthread_mutex_lock(&limiter->lock);
+
+  before = (int)limiter->limit;
+  limiter->inflight--;
+
+  if (outcome == LIMITER_DROPPED) {
+    limiter_cut(limiter, token, 0.5);
+  } else if (outcome == LIMITER_OK) {
+    if (latency > 0) {
+      /* creep upwards, so that a lasting change of route or server load
+       * eventually becomes the new normal */
+      if (limiter->baseline == 0 || latency < limiter->baseline) {
+        limiter->baseline = latency;
+      } else {
+        limiter->baseline += (latency - limiter->baseline) / 256;
+      }
+    }
+
+    if (latency > 0 && latency > limiter->baseline * LIMITER_TOLERANCE) {
+      limiter_cut(limiter, token, 0.9);
+    } else if (limiter->inflight + 1 >= (int)limiter->limit) {
+      /* only grow while the limit is actually what's holding us back */
+      limiter->limit += limiter->slowstart ? 1 : 1 / limiter->limit;
+      if (limiter->limit > limiter->max) {
+        limiter->limit = limiter->max;
+      }
+    }
+  }
+
+  after = (int)limiter->limit;
+  pthread_cond_broadcast(&limiter->cond);
+  pthread_mutex_unlock(&limiter->lock);
+
+  return after != before ? after : 0;
+}
+
+int limiter_limit(limiter_t *limiter) {
+  int limit;
+
+  pthread_mutex_lock(&limiter->lock);
+  limit = (int)limiter->limit;
+  pthread_mutex_unlock(&limiter->lock);
+
+  return limit;
+}
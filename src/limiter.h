@@ -0,0 +1,40 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <stdint.h>
+
+/* An adaptive limit on the number of requests in flight, in the style of
+ * TCP congestion control. The limit starts low and doubles every round trip
+ * for as long as latency stays near the lowest seen. After the first sign of
+ * trouble it grows by one per round trip instead. Rising latency trims it
+ * a little, while throttling or a timeout halves it. */
+typedef struct limiter_t limiter_t;
+
+typedef enum {
+  /* the request completed; its latency counts */
+  LIMITER_OK,
+  /* the server pushed back, or the request timed out */
+  LIMITER_DROPPED,
+  /* failed for reasons that say nothing about load */
+  LIMITER_IGNORE,
+} limiter_outcome;
+
+int limiter_new(int initial, int max, limiter_t **limiter);
+void limiter_free(limiter_t *limiter);
+
+/* Blocks until a request may start. Returns a token for limiter_release. */
+uint64_t limiter_acquire(limiter_t *limiter);
+
+/* Like limiter_acquire, but returns 0 instead of blocking, and 1 with the
+ * token in *token if the request may start. */
+int limiter_try_acquire(limiter_t *limiter, uint64_t *token);
+
+/* Report how a request went. latency is the time the server took to start
+ * answering, in microseconds, or 0 if unknown. Returns the new limit if this
+ * changed it, or 0 otherwise. */
+int limiter_release(limiter_t *limiter, uint64_t token, limiter_outcome outcome,
+    uint64_t latency);
+
+int limiter_limit(limiter_t *limiter);
+
+#endif  /* LIMITER_H */
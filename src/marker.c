@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "marker.h"
+
+static char *marker_path(const char *dir, const char *suffix) {
+  char *path;
+
+  if (asprintf(&path, "%s/" MARKER_FILENAME "%s", dir, suffix) < 0) {
+    return NULL;
+  }
+
+  return path;
+}
+
+static char *strip(char *s) {
+  char *end;
+
+  while (*s == ' ' || *s == '\t') {
+    s++;
+  }
+
+  end = s + strlen(s);
+  while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r')) {
+    *--end = '\0';
+  }
+
+  return s;
+}
+
+static int marker_set(struct marker_t *marker, const char *key, const char *value) {
+  char **field;
+
+  if (strcmp(key, "lastmodified") == 0) {
+    marker->lastmodified = (time_t)strtoll(value, NULL, 10);
+    return 0;
+  } else if (strcmp(key, "version") == 0) {
+    field = &marker->version;
+  } else if (strcmp(key, "etag") == 0) {
+    field = &marker->etag;
+  } else if (strcmp(key, "file") == 0) {
+    char *file = strdup(value);
+
+    if (file == NULL) {
+      return -ENOMEM;
+    }
+
+    marker->files = alpm_list_add(marker->files, file);
+    return 0;
+  } else {
+    /* unknown keys are from some other version of cower */
+    return 0;
+  }
+
+  free(*field);
+  *field = strdup(value);
+
+  return *field ? 0 : -ENOMEM;
+}
+
+int marker_read(const char *dir, struct marker_t *marker) {
+  char *path, *line = NULL;
+  size_t linesz = 0;
+  FILE *fp;
+  int r = 0;
+
+  memset(marker, 0, sizeof(*marker));
+
+  path = marker_path(dir, "");
+  if (path == NULL) {
+    return -ENOMEM;
+  }
+
+  fp = fopen(path, "r");
+  free(path);
+  if (fp == NULL) {
+    return -errno;
+  }
+
+  while (getline(&line, &linesz, fp) != -1) {
+    char *eq = strchr(line, '=');
+
+    if (eq == NULL) {
+      continue;
+    }
+
+    *eq = '\0';
+    r = marker_set(marker, strip(line), strip(eq + 1));
+    if (r < 0) {
+      break;
+    }
+  }
+
+  free(line);
+  fclose(fp);
+
+  if (r == 0 && marker->version == NULL) {
+    r = -EBADMSG;
+  }
+
+  if (r < 0) {
+    marker_clear(marker);
+  }
+
+  return r;
+}
+
+int marker_write(const char *dir, const struct marker_t *marker) {
+  char *path = NULL, *tmppath = NULL;
+  const alpm_list_t *i;
+  FILE *fp;
+  int r = 0;
+
+  path = marker_path(dir, "");
+  tmppath = marker_path(dir, ".tmp");
+  if (path == NULL || tmppath == NULL) {
+    r = -ENOMEM;
+    goto finish;
+  }
+
+  /* write aside and rename, so a reader never sees half a marker */
+  fp = fopen(tmppath, "w");
+  if (fp == NULL) {
+    r = -errno;
+    goto finish;
+  }
+
+  fprintf(fp, "lastmodified = %lld\n", (long long)marker->lastmodified);
+  fprintf(fp, "version = %s\n", marker->version);
+  if (marker->etag != NULL) {
+    fprintf(fp, "etag = %s\n", marker->etag);
+  }
+  for (i = marker->files; i; i = i->next) {
+    fprintf(fp, "file = %s\n", (const char *)i->data);
+  }
+
+  if (ferror(fp)) {
+    r = -EIO;
+  }
+
+  if (fclose(fp) != 0 && r == 0) {
+    r = -errno;
+  }
+
+  if (r < 0) {
+    unlink(tmppath);
+    goto finish;
+  }
+
+  if (rename(tmppath, path) < 0) {
+    r = -errno;
+    unlink(tmppath);
+  }
+
+finish:
+  free(path);
+  free(tmppath);
+
+  return r;
+}
+
+void marker_clear(struct marker_t *marker) {
+  free(marker->version);
+  free(marker->etag);
+  FREELIST(marker->files);
+  memset(marker, 0, sizeof(*marker));
+}
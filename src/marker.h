@@ -0,0 +1,30 @@
+#ifndef MARKER_H
+#define MARKER_H
+
+#include <time.h>
+
+#include <alpm_list.h>
+
+/* Records which snapshot a pkgbase directory was extracted from, so that an
+ * unchanged snapshot needn't be fetched again. The marker lives inside the
+ * pkgbase directory itself. */
+struct marker_t {
+  time_t lastmodified;
+  char *version;
+  /* may be NULL if the server didn't send one */
+  char *etag;
+  /* files and symlinks the snapshot contained, relative to the directory the
+   * pkgbase was extracted into */
+  alpm_list_t *files;
+};
+
+#define MARKER_FILENAME ".cower"
+
+/* Returns 0 on success, or a negative errno. A missing or unreadable marker
+ * is not an error the caller needs to report; it just means the directory's
+ * provenance is unknown. */
+int marker_read(const char *dir, struct marker_t *marker);
+int marker_write(const char *dir, const struct marker_t *marker);
+void marker_clear(struct marker_t *marker);
+
+#endif  /* MARKER_H */
@@ -0,0 +1,191 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "output.h"
+
+struct output_t {
+  int fd;
+  int error;
+
+  char *data;
+  size_t len;
+  size_t size;
+};
+
+int output_new(int fd, size_t size, output_t **out) {
+  output_t *o;
+
+  o = calloc(1, sizeof(*o));
+  if (o == NULL) {
+    return -ENOMEM;
+  }
+
+  o->data = malloc(size);
+  if (o->data == NULL) {
+    free(o);
+    return -ENOMEM;
+  }
+
+  o->fd = fd;
+  o->size = size;
+
+  *out = o;
+  return 0;
+}
+
+void output_free(output_t *out) {
+  if (out == NULL) {
+    return;
+  }
+
+  output_flush(out);
+  free(out->data);
+  free(out);
+}
+
+/* Write out the buffer followed by extra, which is too big to be worth
+ * copying in first. */
+static void output_writev(output_t *out, const char *extra, size_t extralen) {
+  struct iovec iov[2] = {
+    { out->data, out->len },
+    { (void *)extra, extralen },
+  };
+  struct iovec *v = iov;
+  int count = 2;
+
+  while (count > 0 && out->error == 0) {
+    ssize_t n = writev(out->fd, v, count);
+
+    if (n < 0) {
+      if (errno != EINTR) {
+        out->error = -errno;
+      }
+      continue;
+    }
+
+    while (count > 0 && (size_t)n >= v->iov_len) {
+      n -= v->iov_len;
+      v++;
+      count--;
+    }
+    if (count > 0) {
+      v->iov_base = (char *)v->iov_base + n;
+      v->iov_len -= n;
+    }
+  }
+
+  out->len = 0;
+}
+
+void output_write(output_t *out, const char *data, size_t len) {
+  if (len == 0) {
+    return;
+  }
+
+  if (out->len + len <= out->size) {
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+  } else {
+    output_writev(out, data, len);
+  }
+}
+
+void output_puts(output_t *out, const char *str) {
+  output_write(out, str, strlen(str));
+}
+
+void output_putc(output_t *out, char c) {
+  if (out->len == out->size) {
+    output_writev(out, NULL, 0);
+  }
+
+  out->data[out->len++] = c;
+}
+
+void output_pad(output_t *out, size_t len) {
+  while (len > 0) {
+    size_t n;
+
+    if (out->len == out->size) {
+      output_writev(out, NULL, 0);
+    }
+
+    n = out->size - out->len < len ? out->size - out->len : len;
+    memset(out->data + out->len, ' ', n);
+    out->len += n;
+    len -= n;
+  }
+}
+
+void output_long(output_t *out, long value, size_t width, int left) {
+  char digits[24], *d = digits + sizeof(digits);
+  unsigned long v = value < 0 ? -(unsigned long)value : (unsigned long)value;
+  size_t len, pad;
+
+  do {
+    *--d = '0' + v % 10;
+    v /= 10;
+  } while (v > 0);
+
+  if (value < 0) {
+    *--d = '-';
+  }
+
+  len = digits + sizeof(digits) - d;
+  pad = width > len ? width - len : 0;
+
+  if (!left) {
+    output_pad(out, pad);
+  }
+  output_write(out, d, len);
+  if (left) {
+    output_pad(out, pad);
+  }
+}
+
+void output_printf(output_t *out, const char *format, ...) {
+  va_list ap;
+  char *str;
+  int len;
+
+  /* formatted in place when there's room, which is nearly always */
+  va_start(ap, format);
+  len = vsnprintf(out->data + out->len, out->size - out->len, format, ap);
+  va_end(ap);
+
+  if (len < 0) {
+    return;
+  }
+
+  if ((size_t)len < out->size - out->len) {
+    out->len += len;
+    return;
+  }
+
+  va_start(ap, format);
+  len = vasprintf(&str, format, ap);
+  va_end(ap);
+
+  if (len >= 0) {
+    output_write(out, str, len);
+    free(str);
+  }
+}
+
+int output_flush(output_t *out) {
+  int r;
+
+  if (out->len > 0) {
+    output_writev(out, NULL, 0);
+  }
+
+  r = out->error;
+  out->error = 0;
+
+  return r;
+}
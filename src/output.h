@@ -0,0 +1,30 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+
+/* Buffered writes to a file descriptor, for printing results. Everything is
+ * collected in one large buffer and written out when it fills up or when
+ * flushed, so that a long listing costs a handful of syscalls rather than
+ * several per package. Not safe to share between threads. */
+typedef struct output_t output_t;
+
+int output_new(int fd, size_t size, output_t **out);
+/* Flushes whatever is left. */
+void output_free(output_t *out);
+
+void output_write(output_t *out, const char *data, size_t len);
+void output_puts(output_t *out, const char *str);
+void output_putc(output_t *out, char c);
+/* Write len spaces. */
+void output_pad(output_t *out, size_t len);
+/* Write value in decimal, padded with spaces to width. The padding goes after
+ * it if left is set, and before it otherwise. */
+void output_long(output_t *out, long value, size_t width, int left);
+void output_printf(output_t *out, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Returns 0, or the first error encountered writing since the last flush. */
+int output_flush(output_t *out);
+
+#endif  /* OUTPUT_H */
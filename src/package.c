@@ -5,6 +5,7 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include <yajl/yajl_gen.h>
 #include <yajl/yajl_tree.h>
 
 #include "macro.h"
@@ -23,6 +24,85 @@ static void free_strv(char **strv) {
   free(strv);
 }
 
+static int dup_str(const char *s, char **dest) {
+  if (s == NULL) {
+    *dest = NULL;
+    return 0;
+  }
+
+  *dest = strdup(s);
+  return *dest ? 0 : -ENOMEM;
+}
+
+static int dup_strv(char **strv, char ***dest) {
+  size_t i, len = 0;
+  char **t;
+
+  *dest = NULL;
+  if (strv == NULL) {
+    return 0;
+  }
+
+  while (strv[len]) {
+    ++len;
+  }
+
+  t = calloc(len + 1, sizeof(char*));
+  if (t == NULL) {
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < len; ++i) {
+    t[i] = strdup(strv[i]);
+    if (t[i] == NULL) {
+      free_strv(t);
+      return -ENOMEM;
+    }
+  }
+
+  *dest = t;
+  return 0;
+}
+
+aurpkg_t *aur_package_dup(const aurpkg_t *package) {
+  aurpkg_t *p;
+  int r = 0;
+
+  p = malloc(sizeof(*p));
+  if (p == NULL) {
+    return NULL;
+  }
+
+  /* take the scalars, then replace every pointer with a copy */
+  *p = *package;
+
+  r |= dup_str(package->name, &p->name);
+  r |= dup_str(package->description, &p->description);
+  r |= dup_str(package->maintainer, &p->maintainer);
+  r |= dup_str(package->pkgbase, &p->pkgbase);
+  r |= dup_str(package->upstream_url, &p->upstream_url);
+  r |= dup_str(package->aur_urlpath, &p->aur_urlpath);
+  r |= dup_str(package->version, &p->version);
+
+  r |= dup_strv(package->licenses, &p->licenses);
+  r |= dup_strv(package->conflicts, &p->conflicts);
+  r |= dup_strv(package->depends, &p->depends);
+  r |= dup_strv(package->groups, &p->groups);
+  r |= dup_strv(package->makedepends, &p->makedepends);
+  r |= dup_strv(package->optdepends, &p->optdepends);
+  r |= dup_strv(package->checkdepends, &p->checkdepends);
+  r |= dup_strv(package->provides, &p->provides);
+  r |= dup_strv(package->replaces, &p->replaces);
+  r |= dup_strv(package->keywords, &p->keywords);
+
+  if (r != 0) {
+    aur_package_free(p);
+    return NULL;
+  }
+
+  return p;
+}
+
 void aur_package_free(aurpkg_t *package) {
   if (package == NULL) {
     return;
@@ -70,12 +150,63 @@ static void aur_packages_freep(aurpkg_t ***packages) {
 
 #define _cleanup_packages_free_ __attribute__((cleanup(aur_packages_freep)))
 
+/* what a field in aurpkg_t is stored as */
+typedef enum {
+  FIELD_STRING,
+  FIELD_STRINGS,
+  FIELD_INT,
+  FIELD_TIME,
+  /* a time, or 0 when the RPC sent null */
+  FIELD_TIME_OR_NULL,
+  FIELD_DOUBLE,
+} field_type;
+
 struct json_descriptor_t {
   const char *key;
-  yajl_type type;
+  field_type type;
   size_t offset;
 };
 
+/* sorted by key, for bsearch */
+static const struct json_descriptor_t kPackageFields[] = {
+  {"CategoryID",     FIELD_INT,          offsetof(aurpkg_t, category_id) },
+  {"CheckDepends",   FIELD_STRINGS,      offsetof(aurpkg_t, checkdepends) },
+  {"Conflicts",      FIELD_STRINGS,      offsetof(aurpkg_t, conflicts) },
+  {"Depends",        FIELD_STRINGS,      offsetof(aurpkg_t, depends) },
+  {"Description",    FIELD_STRING,       offsetof(aurpkg_t, description) },
+  {"FirstSubmitted", FIELD_TIME,         offsetof(aurpkg_t, submitted_s) },
+  {"Groups",         FIELD_STRINGS,      offsetof(aurpkg_t, groups) },
+  {"ID",             FIELD_INT,          offsetof(aurpkg_t, package_id) },
+  {"Keywords",       FIELD_STRINGS,      offsetof(aurpkg_t, keywords) },
+  {"LastModified",   FIELD_TIME,         offsetof(aurpkg_t, modified_s) },
+  {"License",        FIELD_STRINGS,      offsetof(aurpkg_t, licenses) },
+  {"Maintainer",     FIELD_STRING,       offsetof(aurpkg_t, maintainer) },
+  {"MakeDepends",    FIELD_STRINGS,      offsetof(aurpkg_t, makedepends) },
+  {"Name",           FIELD_STRING,       offsetof(aurpkg_t, name) },
+  {"NumVotes",       FIELD_INT,          offsetof(aurpkg_t, votes) },
+  {"OptDepends",     FIELD_STRINGS,      offsetof(aurpkg_t, optdepends) },
+  {"OutOfDate",      FIELD_TIME_OR_NULL, offsetof(aurpkg_t, out_of_date) },
+  {"PackageBase",    FIELD_STRING,       offsetof(aurpkg_t, pkgbase) },
+  {"PackageBaseID",  FIELD_INT,          offsetof(aurpkg_t, pkgbaseid) },
+  {"Popularity",     FIELD_DOUBLE,       offsetof(aurpkg_t, popularity) },
+  {"Provides",       FIELD_STRINGS,      offsetof(aurpkg_t, provides) },
+  {"Replaces",       FIELD_STRINGS,      offsetof(aurpkg_t, replaces) },
+  {"URL",            FIELD_STRING,       offsetof(aurpkg_t, upstream_url) },
+  {"URLPath",        FIELD_STRING,       offsetof(aurpkg_t, aur_urlpath) },
+  {"Version",        FIELD_STRING,       offsetof(aurpkg_t, version) },
+};
+
+static yajl_type json_type(field_type type) {
+  switch (type) {
+    case FIELD_STRING:
+      return yajl_t_string;
+    case FIELD_STRINGS:
+      return yajl_t_array;
+    default:
+      return yajl_t_number;
+  }
+}
+
 static int json_map_key_cmp(const void *a, const void *b) {
   const struct json_descriptor_t *j = a, *k = b;
 
@@ -98,13 +229,19 @@ static int copy_to_string(yajl_val node, char **s) {
 }
 
 static int copy_to_double(yajl_val node, double *d) {
-  *d = YAJL_GET_DOUBLE(node);
+  *d = YAJL_IS_DOUBLE(node) ? YAJL_GET_DOUBLE(node) : YAJL_GET_INTEGER(node);
 
   return 0;
 }
 
 static int copy_to_integer(yajl_val node, int *i) {
-  *i = YAJL_GET_INTEGER(node);
+  *i = YAJL_IS_INTEGER(node) ? YAJL_GET_INTEGER(node) : YAJL_GET_DOUBLE(node);
+
+  return 0;
+}
+
+static int copy_to_time(yajl_val node, time_t *t) {
+  *t = YAJL_IS_INTEGER(node) ? YAJL_GET_INTEGER(node) : YAJL_GET_DOUBLE(node);
 
   return 0;
 }
@@ -155,22 +292,31 @@ static int copy_to_object(yajl_val node, const struct json_descriptor_t table[],
       continue;
     }
 
-    if (v->type != json_desc->type) {
-      fprintf(stderr, "error: type mismatch for key=%s: got=%d, expected=%d\n", k, v->type, json_desc->type);
+    if (v->type != json_type(json_desc->type)) {
+      fprintf(stderr, "error: type mismatch for key=%s: got=%d, expected=%d\n", k, v->type,
+          json_type(json_desc->type));
       continue;
     }
 
+    /* numbers are stored as whatever the field is, however they were sent */
     dest = output_base + json_desc->offset;
-    if (YAJL_IS_STRING(v)) {
-      r = copy_to_string(v, dest);
-    } else if (YAJL_IS_INTEGER(v)) {
-      r = copy_to_integer(v, dest);
-    } else if (YAJL_IS_DOUBLE(v)) {
-      r = copy_to_double(v, dest);
-    } else if (YAJL_IS_ARRAY(v)) {
-      r = copy_to_array(v, dest);
-    } else {
-      fprintf(stderr, "warning: unhandled type %d for key %s\n", v->type, k);
+    switch (json_desc->type) {
+      case FIELD_STRING:
+        r = copy_to_string(v, dest);
+        break;
+      case FIELD_STRINGS:
+        r = copy_to_array(v, dest);
+        break;
+      case FIELD_INT:
+        r = copy_to_integer(v, dest);
+        break;
+      case FIELD_TIME:
+      case FIELD_TIME_OR_NULL:
+        r = copy_to_time(v, dest);
+        break;
+      case FIELD_DOUBLE:
+        r = copy_to_double(v, dest);
+        break;
     }
 
     if (r < 0) {
@@ -188,34 +334,6 @@ int aur_packages_from_json(const char *json, aurpkg_t ***packages, int *count) {
   _cleanup_packages_free_ aurpkg_t **p = NULL;
   size_t i;
 
-  static const struct json_descriptor_t table[] = {
-    {"CategoryID",     yajl_t_number, offsetof(aurpkg_t, category_id) },
-    {"CheckDepends",   yajl_t_array,  offsetof(aurpkg_t, checkdepends) },
-    {"Conflicts",      yajl_t_array,  offsetof(aurpkg_t, conflicts) },
-    {"Depends",        yajl_t_array,  offsetof(aurpkg_t, depends) },
-    {"Description",    yajl_t_string, offsetof(aurpkg_t, description) },
-    {"FirstSubmitted", yajl_t_number, offsetof(aurpkg_t, submitted_s) },
-    {"Groups",         yajl_t_array,  offsetof(aurpkg_t, groups) },
-    {"ID",             yajl_t_number, offsetof(aurpkg_t, package_id) },
-    {"Keywords",       yajl_t_array,  offsetof(aurpkg_t, keywords) },
-    {"LastModified",   yajl_t_number, offsetof(aurpkg_t, modified_s) },
-    {"License",        yajl_t_array,  offsetof(aurpkg_t, licenses) },
-    {"Maintainer",     yajl_t_string, offsetof(aurpkg_t, maintainer) },
-    {"MakeDepends",    yajl_t_array,  offsetof(aurpkg_t, makedepends) },
-    {"Name",           yajl_t_string, offsetof(aurpkg_t, name) },
-    {"NumVotes",       yajl_t_number, offsetof(aurpkg_t, votes) },
-    {"OptDepends",     yajl_t_array,  offsetof(aurpkg_t, optdepends) },
-    {"OutOfDate",      yajl_t_number, offsetof(aurpkg_t, out_of_date) },
-    {"PackageBase",    yajl_t_string, offsetof(aurpkg_t, pkgbase) },
-    {"PackageBaseID",  yajl_t_number, offsetof(aurpkg_t, pkgbaseid) },
-    {"Popularity",     yajl_t_number, offsetof(aurpkg_t, popularity) },
-    {"Provides",       yajl_t_array,  offsetof(aurpkg_t, provides) },
-    {"Replaces",       yajl_t_array,  offsetof(aurpkg_t, licenses) },
-    {"URL",            yajl_t_string, offsetof(aurpkg_t, upstream_url) },
-    {"URLPath",        yajl_t_string, offsetof(aurpkg_t, aur_urlpath) },
-    {"Version",        yajl_t_string, offsetof(aurpkg_t, version) },
-  };
-
   node = yajl_tree_parse(json, error_buffer, sizeof(error_buffer));
   if (node == NULL) {
     return -EINVAL;
@@ -240,7 +358,7 @@ int aur_packages_from_json(const char *json, aurpkg_t ***packages, int *count) {
         return -ENOMEM;
       }
 
-      r = copy_to_object(YAJL_GET_ARRAY(results)->values[i], table, ARRAYSIZE(table), (uint8_t*)p[i]);
+      r = copy_to_object(YAJL_GET_ARRAY(results)->values[i], kPackageFields, ARRAYSIZE(kPackageFields), (uint8_t*)p[i]);
       if (r < 0) {
         return r;
       }
@@ -256,6 +374,73 @@ int aur_packages_from_json(const char *json, aurpkg_t ***packages, int *count) {
   return 0;
 }
 
+static yajl_gen_status gen_string(yajl_gen gen, const char *s) {
+  return yajl_gen_string(gen, (const unsigned char *)s, strlen(s));
+}
+
+int aur_package_to_json(const aurpkg_t *package, yajl_gen gen) {
+  yajl_gen_status status;
+  size_t i;
+
+  status = yajl_gen_map_open(gen);
+
+  for (i = 0; i < ARRAYSIZE(kPackageFields) && status == yajl_gen_status_ok; ++i) {
+    const struct json_descriptor_t *field = &kPackageFields[i];
+    const void *src = (const uint8_t *)package + field->offset;
+    char *const *strv;
+    time_t t;
+
+    /* lists the RPC didn't send are left out, as it would have done */
+    if (field->type == FIELD_STRINGS && *(char **const *)src == NULL) {
+      continue;
+    }
+
+    status = gen_string(gen, field->key);
+    if (status != yajl_gen_status_ok) {
+      break;
+    }
+
+    switch (field->type) {
+      case FIELD_STRING:
+        if (*(char *const *)src == NULL) {
+          status = yajl_gen_null(gen);
+        } else {
+          status = gen_string(gen, *(char *const *)src);
+        }
+        break;
+      case FIELD_STRINGS:
+        status = yajl_gen_array_open(gen);
+        for (strv = *(char **const *)src; *strv && status == yajl_gen_status_ok; ++strv) {
+          status = gen_string(gen, *strv);
+        }
+        if (status == yajl_gen_status_ok) {
+          status = yajl_gen_array_close(gen);
+        }
+        break;
+      case FIELD_INT:
+        status = yajl_gen_integer(gen, *(const int *)src);
+        break;
+      case FIELD_TIME:
+        status = yajl_gen_integer(gen, *(const time_t *)src);
+        break;
+      case FIELD_TIME_OR_NULL:
+        /* never, which the RPC sends as null */
+        t = *(const time_t *)src;
+        status = t == 0 ? yajl_gen_null(gen) : yajl_gen_integer(gen, t);
+        break;
+      case FIELD_DOUBLE:
+        status = yajl_gen_double(gen, *(const double *)src);
+        break;
+    }
+  }
+
+  if (status == yajl_gen_status_ok) {
+    status = yajl_gen_map_close(gen);
+  }
+
+  return status == yajl_gen_status_ok ? 0 : -EINVAL;
+}
+
 int aur_packages_count(aurpkg_t **l) {
   aurpkg_t **p;
   int count = 0;
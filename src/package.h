@@ -3,6 +3,8 @@
 
 #include <sys/types.h>
 
+#include <yajl/yajl_gen.h>
+
 struct aurpkg_t {
   char *name;
   char *description;
@@ -37,7 +39,10 @@ struct aurpkg_t {
 typedef struct aurpkg_t aurpkg_t;
 
 int aur_packages_from_json(const char *json, aurpkg_t ***packages, int *count);
+/* Write a package out as an object with the same keys the RPC uses. */
+int aur_package_to_json(const aurpkg_t *package, yajl_gen gen);
 
+aurpkg_t *aur_package_dup(const aurpkg_t *package);
 void aur_package_free(aurpkg_t *package);
 void aur_packages_free(aurpkg_t **packages);
 
@@ -0,0 +1,72 @@
+#include <errno.h>
+#include <stdlib.h>
+
+#include "flight.h"
+#include "pkgcache.h"
+
+struct pkgcache_t {
+  flight_t *packages;
+};
+
+static void package_free(void *package) {
+  aur_package_free(package);
+}
+
+int pkgcache_new(pkgcache_t **cache) {
+  pkgcache_t *c;
+  int r;
+
+  c = calloc(1, sizeof(*c));
+  if (c == NULL) {
+    return -ENOMEM;
+  }
+
+  r = flight_new(&c->packages, package_free);
+  if (r < 0) {
+    free(c);
+    return r;
+  }
+
+  *cache = c;
+  return 0;
+}
+
+void pkgcache_free(pkgcache_t *cache) {
+  if (cache == NULL) {
+    return;
+  }
+
+  flight_free(cache->packages);
+  free(cache);
+}
+
+int pkgcache_get(pkgcache_t *cache, const char *name, int wait, aurpkg_t **package) {
+  void *cached;
+  int r;
+
+  *package = NULL;
+
+  /* cached packages are never changed once recorded, so they can be copied
+   * without holding anything */
+  r = flight_get(cache->packages, name, wait, &cached);
+  if (r == FLIGHT_HIT && cached != NULL) {
+    *package = aur_package_dup(cached);
+  }
+
+  switch (r) {
+    case FLIGHT_MISS:
+      return PKGCACHE_MISS;
+    case FLIGHT_BUSY:
+      return PKGCACHE_BUSY;
+    default:
+      return PKGCACHE_HIT;
+  }
+}
+
+void pkgcache_put(pkgcache_t *cache, const char *name, const aurpkg_t *package) {
+  flight_put(cache->packages, name, package ? aur_package_dup(package) : NULL);
+}
+
+void pkgcache_abandon(pkgcache_t *cache, const char *name) {
+  flight_abandon(cache->packages, name);
+}
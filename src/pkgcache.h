@@ -0,0 +1,36 @@
+#ifndef PKGCACHE_H
+#define PKGCACHE_H
+
+#include "package.h"
+
+/* Package metadata fetched during this run, keyed by package name, so that
+ * no package's info needs to be fetched more than once. Lookups are single
+ * flight: the first caller to miss on a name is responsible for fetching it,
+ * and anyone else asking for that name in the meantime waits for the answer
+ * rather than issuing a request of their own. */
+typedef struct pkgcache_t pkgcache_t;
+
+enum {
+  PKGCACHE_HIT = 0,
+  PKGCACHE_MISS,
+  PKGCACHE_BUSY,
+};
+
+int pkgcache_new(pkgcache_t **cache);
+void pkgcache_free(pkgcache_t *cache);
+
+/* On PKGCACHE_HIT, *package is a copy of the cached package, or NULL if the
+ * AUR doesn't know about name. On PKGCACHE_MISS, the caller must fetch name
+ * and report the outcome with pkgcache_put. If wait is zero, PKGCACHE_BUSY is
+ * returned instead of blocking on another caller's fetch. */
+int pkgcache_get(pkgcache_t *cache, const char *name, int wait, aurpkg_t **package);
+
+/* Record the result of fetching name. package may be NULL if nothing was
+ * found, and is copied. */
+void pkgcache_put(pkgcache_t *cache, const char *name, const aurpkg_t *package);
+
+/* Give up a claim on name without an answer, so that the next caller, or one
+ * already waiting, fetches it instead. */
+void pkgcache_abandon(pkgcache_t *cache, const char *name);
+
+#endif  /* PKGCACHE_H */
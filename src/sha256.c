@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "sha256.h"
+
+/* FIPS 180-4 */
+
+static const uint32_t kRoundConstants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(uint32_t state[8], const unsigned char *block) {
+  uint32_t w[64], a, b, c, d, e, f, g, h;
+  int i;
+
+  for (i = 0; i < 16; ++i) {
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+        (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+  }
+
+  for (i = 16; i < 64; ++i) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  d = state[3];
+  e = state[4];
+  f = state[5];
+  g = state[6];
+  h = state[7];
+
+  for (i = 0; i < 64; ++i) {
+    uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) +
+        kRoundConstants[i] + w[i];
+    uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+void sha256_hex(const void *data, size_t size, char hex[SHA256_HEXLEN + 1]) {
+  static const char kHexDigits[] = "0123456789abcdef";
+  uint32_t state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+  const unsigned char *p = data;
+  unsigned char tail[128];
+  size_t left = size, taillen;
+  uint64_t bits = (uint64_t)size * 8;
+  int i;
+
+  for (; left >= 64; p += 64, left -= 64) {
+    sha256_block(state, p);
+  }
+
+  /* the rest, a one bit, zeroes, and the length in bits fill one or two
+   * final blocks */
+  memset(tail, 0, sizeof(tail));
+  if (left > 0) {
+    memcpy(tail, p, left);
+  }
+  tail[left] = 0x80;
+  taillen = left < 56 ? 64 : 128;
+  for (i = 0; i < 8; ++i) {
+    tail[taillen - 1 - i] = (unsigned char)(bits >> (i * 8));
+  }
+
+  sha256_block(state, tail);
+  if (taillen == 128) {
+    sha256_block(state, tail + 64);
+  }
+
+  for (i = 0; i < 32; ++i) {
+    unsigned char byte = (unsigned char)(state[i / 4] >> (24 - (i % 4) * 8));
+
+    hex[i * 2] = kHexDigits[byte >> 4];
+    hex[i * 2 + 1] = kHexDigits[byte & 0xf];
+  }
+  hex[SHA256_HEXLEN] = '\0';
+}
@@ -0,0 +1,13 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+
+#define SHA256_HEXLEN 64
+
+/* Writes the sha256 sum of size bytes at data into hex, as lowercase hex
+ * followed by a NUL. For contents already in memory, where going through a
+ * file to hash them would mean reading them all over again. */
+void sha256_hex(const void *data, size_t size, char hex[SHA256_HEXLEN + 1]);
+
+#endif  /* SHA256_H */
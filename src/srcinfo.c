@@ -0,0 +1,266 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macro.h"
+#include "srcinfo.h"
+
+static const struct {
+  const char *key;
+  srcinfo_deptype type;
+} deptype_table[] = {
+  { "depends",      SRCINFO_DEPENDS },
+  { "makedepends",  SRCINFO_MAKEDEPENDS },
+  { "checkdepends", SRCINFO_CHECKDEPENDS },
+  { "optdepends",   SRCINFO_OPTDEPENDS },
+};
+
+static int span_eq(const struct srcinfo_span_t *a, const struct srcinfo_span_t *b) {
+  return a->len == b->len && memcmp(a->ptr, b->ptr, a->len) == 0;
+}
+
+static int span_eq_str(const struct srcinfo_span_t *a, const char *s) {
+  return strncmp(a->ptr, s, a->len) == 0 && s[a->len] == '\0';
+}
+
+static int is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static void span_trim(struct srcinfo_span_t *s) {
+  while (s->len > 0 && is_blank(*s->ptr)) {
+    s->ptr++;
+    s->len--;
+  }
+
+  while (s->len > 0 && is_blank(s->ptr[s->len - 1])) {
+    s->len--;
+  }
+}
+
+/* Match keys of the form "depends" or "depends_$arch". */
+static int parse_depkey(const struct srcinfo_span_t *key, srcinfo_deptype *type,
+    struct srcinfo_span_t *arch) {
+  size_t i;
+
+  for (i = 0; i < ARRAYSIZE(deptype_table); ++i) {
+    size_t keylen = strlen(deptype_table[i].key);
+
+    if (key->len < keylen || memcmp(key->ptr, deptype_table[i].key, keylen) != 0) {
+      continue;
+    }
+
+    if (key->len == keylen) {
+      arch->ptr = key->ptr + keylen;
+      arch->len = 0;
+    } else if (key->ptr[keylen] == '_' && key->len > keylen + 1) {
+      arch->ptr = key->ptr + keylen + 1;
+      arch->len = key->len - keylen - 1;
+    } else {
+      continue;
+    }
+
+    *type = deptype_table[i].type;
+    return 1;
+  }
+
+  return 0;
+}
+
+static int pkg_add_dep(struct srcinfo_pkg_t *pkg, srcinfo_deptype type,
+    const struct srcinfo_span_t *arch, const struct srcinfo_span_t *value) {
+  struct srcinfo_dep_t *dep;
+
+  if (pkg->ndeps == pkg->capacity) {
+    size_t newcap = pkg->capacity ? pkg->capacity * 2 : 16;
+    struct srcinfo_dep_t *newdeps;
+
+    newdeps = realloc(pkg->deps, newcap * sizeof(*newdeps));
+    if (newdeps == NULL) {
+      return -ENOMEM;
+    }
+
+    pkg->deps = newdeps;
+    pkg->capacity = newcap;
+  }
+
+  dep = &pkg->deps[pkg->ndeps++];
+  dep->type = type;
+  dep->arch = *arch;
+  dep->value = *value;
+
+  return 0;
+}
+
+static struct srcinfo_pkg_t *srcinfo_add_pkg(srcinfo_t *srcinfo, const struct srcinfo_span_t *name) {
+  struct srcinfo_pkg_t *pkgs;
+
+  pkgs = realloc(srcinfo->pkgs, (srcinfo->npkgs + 1) * sizeof(*pkgs));
+  if (pkgs == NULL) {
+    return NULL;
+  }
+
+  srcinfo->pkgs = pkgs;
+  memset(&pkgs[srcinfo->npkgs], 0, sizeof(*pkgs));
+  pkgs[srcinfo->npkgs].name = *name;
+
+  return &pkgs[srcinfo->npkgs++];
+}
+
+int srcinfo_parse(const char *data, size_t len, srcinfo_t **srcinfo) {
+  const char *p = data, *end = data + len;
+  struct srcinfo_pkg_t *section = NULL;
+  srcinfo_t *s;
+
+  s = calloc(1, sizeof(*s));
+  if (s == NULL) {
+    return -ENOMEM;
+  }
+
+  while (p < end) {
+    struct srcinfo_span_t line, key, value, arch;
+    const char *eol, *eq;
+    srcinfo_deptype type;
+
+    eol = memchr(p, '\n', end - p);
+    if (eol == NULL) {
+      eol = end;
+    }
+
+    line.ptr = p;
+    line.len = eol - p;
+    p = eol + 1;
+
+    span_trim(&line);
+    if (line.len == 0 || *line.ptr == '#') {
+      continue;
+    }
+
+    eq = memchr(line.ptr, '=', line.len);
+    if (eq == NULL) {
+      continue;
+    }
+
+    key.ptr = line.ptr;
+    key.len = eq - line.ptr;
+    value.ptr = eq + 1;
+    value.len = line.len - key.len - 1;
+    span_trim(&key);
+    span_trim(&value);
+
+    if (span_eq_str(&key, "pkgbase")) {
+      s->pkgbase.name = value;
+      section = &s->pkgbase;
+    } else if (span_eq_str(&key, "pkgname")) {
+      section = srcinfo_add_pkg(s, &value);
+      if (section == NULL) {
+        srcinfo_free(s);
+        return -ENOMEM;
+      }
+    } else if (section != NULL && parse_depkey(&key, &type, &arch)) {
+      /* an empty value in the pkgbase section is meaningless, but in a
+       * package section it records that the array was cleared. */
+      if (value.len == 0 && section == &s->pkgbase) {
+        continue;
+      }
+
+      if (pkg_add_dep(section, type, &arch, &value) < 0) {
+        srcinfo_free(s);
+        return -ENOMEM;
+      }
+    }
+  }
+
+  if (s->pkgbase.name.ptr == NULL) {
+    srcinfo_free(s);
+    return -EBADMSG;
+  }
+
+  *srcinfo = s;
+  return 0;
+}
+
+void srcinfo_free(srcinfo_t *srcinfo) {
+  size_t i;
+
+  if (srcinfo == NULL) {
+    return;
+  }
+
+  for (i = 0; i < srcinfo->npkgs; ++i) {
+    free(srcinfo->pkgs[i].deps);
+  }
+
+  free(srcinfo->pkgs);
+  free(srcinfo->pkgbase.deps);
+  free(srcinfo);
+}
+
+const struct srcinfo_pkg_t *srcinfo_find_pkg(const srcinfo_t *srcinfo, const char *pkgname) {
+  size_t i;
+
+  for (i = 0; i < srcinfo->npkgs; ++i) {
+    if (span_eq_str(&srcinfo->pkgs[i].name, pkgname)) {
+      return &srcinfo->pkgs[i];
+    }
+  }
+
+  return NULL;
+}
+
+static int dep_applies(const struct srcinfo_dep_t *dep, unsigned typemask, const char *arch) {
+  if (!(typemask & SRCINFO_DEPTYPE_MASK(dep->type))) {
+    return 0;
+  }
+
+  return dep->arch.len == 0 || (arch != NULL && span_eq_str(&dep->arch, arch));
+}
+
+static int pkg_overrides(const struct srcinfo_pkg_t *pkg, const struct srcinfo_dep_t *dep) {
+  size_t i;
+
+  for (i = 0; i < pkg->ndeps; ++i) {
+    if (pkg->deps[i].type == dep->type && span_eq(&pkg->deps[i].arch, &dep->arch)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int walk_deps(const struct srcinfo_pkg_t *pkg, const struct srcinfo_pkg_t *override,
+    unsigned typemask, const char *arch, srcinfo_dep_fn fn, void *userdata) {
+  size_t i;
+
+  for (i = 0; i < pkg->ndeps; ++i) {
+    const struct srcinfo_dep_t *dep = &pkg->deps[i];
+    int r;
+
+    if (dep->value.len == 0 || !dep_applies(dep, typemask, arch)) {
+      continue;
+    }
+
+    if (override != NULL && pkg_overrides(override, dep)) {
+      continue;
+    }
+
+    r = fn(dep, userdata);
+    if (r != 0) {
+      return r;
+    }
+  }
+
+  return 0;
+}
+
+int srcinfo_foreach_dep(const srcinfo_t *srcinfo, const struct srcinfo_pkg_t *pkg,
+    unsigned typemask, const char *arch, srcinfo_dep_fn fn, void *userdata) {
+  int r;
+
+  r = walk_deps(&srcinfo->pkgbase, pkg, typemask, arch, fn, userdata);
+  if (r != 0 || pkg == NULL) {
+    return r;
+  }
+
+  return walk_deps(pkg, NULL, typemask, arch, fn, userdata);
+}
@@ -0,0 +1,60 @@
+#ifndef SRCINFO_H
+#define SRCINFO_H
+
+#include <stddef.h>
+
+typedef enum {
+  SRCINFO_DEPENDS = 0,
+  SRCINFO_MAKEDEPENDS,
+  SRCINFO_CHECKDEPENDS,
+  SRCINFO_OPTDEPENDS,
+} srcinfo_deptype;
+
+#define SRCINFO_DEPTYPE_MASK(t) (1u << (t))
+
+/* A view into the buffer handed to srcinfo_parse. Nothing is copied, so the
+ * buffer must outlive the parsed srcinfo_t. */
+struct srcinfo_span_t {
+  const char *ptr;
+  size_t len;
+};
+
+struct srcinfo_dep_t {
+  srcinfo_deptype type;
+  /* empty for arrays which aren't architecture specific */
+  struct srcinfo_span_t arch;
+  /* empty if the array was explicitly cleared in a package section */
+  struct srcinfo_span_t value;
+};
+
+struct srcinfo_pkg_t {
+  struct srcinfo_span_t name;
+
+  struct srcinfo_dep_t *deps;
+  size_t ndeps;
+  size_t capacity;
+};
+
+struct srcinfo_t {
+  struct srcinfo_pkg_t pkgbase;
+
+  struct srcinfo_pkg_t *pkgs;
+  size_t npkgs;
+};
+typedef struct srcinfo_t srcinfo_t;
+
+typedef int (*srcinfo_dep_fn)(const struct srcinfo_dep_t *dep, void *userdata);
+
+int srcinfo_parse(const char *data, size_t len, srcinfo_t **srcinfo);
+void srcinfo_free(srcinfo_t *srcinfo);
+
+const struct srcinfo_pkg_t *srcinfo_find_pkg(const srcinfo_t *srcinfo, const char *pkgname);
+
+/* Walk the dependencies of the given types which apply to arch. If pkg is
+ * NULL, only the pkgbase level arrays are walked. Otherwise, the arrays of pkg
+ * are walked, falling back to pkgbase for any array pkg doesn't override. A
+ * non-zero return from fn stops the walk and is passed back to the caller. */
+int srcinfo_foreach_dep(const srcinfo_t *srcinfo, const struct srcinfo_pkg_t *pkg,
+    unsigned typemask, const char *arch, srcinfo_dep_fn fn, void *userdata);
+
+#endif  /* SRCINFO_H */
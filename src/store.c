@@ -0,0 +1,648 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "sha256.h"
+#include "store.h"
+
+/* temporary files older than this were left behind by a process which died */
+#define STORE_STALE_TMP (24 * 60 * 60)
+
+struct store_t {
+  char *dir;
+  off_t maxsize;
+};
+
+struct store_object_t {
+  char name[SHA256_HEXLEN + 1];
+  time_t mtime;
+  off_t size;
+};
+
+/* Names come from the AUR, but they still become path components. */
+static int valid_name(const char *name) {
+  return *name != '\0' && *name != '.' && strchr(name, '/') == NULL;
+}
+
+static int valid_hash(const char *hash) {
+  return strlen(hash) == SHA256_HEXLEN &&
+      strspn(hash, "0123456789abcdef") == SHA256_HEXLEN;
+}
+
+/* Write data to a new temporary file in dir, whose path is returned in
+ * *tmppath for the caller to rename into place. */
+static int write_tmp(const char *dir, const char *data, size_t size, char **tmppath_out) {
+  char *tmppath;
+  size_t written = 0;
+  int fd, r = 0;
+
+  if (asprintf(&tmppath, "%s/.tmp-XXXXXX", dir) < 0) {
+    return -ENOMEM;
+  }
+
+  fd = mkostemp(tmppath, O_CLOEXEC);
+  if (fd < 0) {
+    r = -errno;
+    free(tmppath);
+    return r;
+  }
+
+  while (written < size) {
+    ssize_t n = write(fd, data + written, size - written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      r = -errno;
+      break;
+    }
+    written += n;
+  }
+
+  /* mkostemp creates files only we can read */
+  if (r == 0 && fchmod(fd, 0644) < 0) {
+    r = -errno;
+  }
+
+  if (close(fd) < 0 && r == 0) {
+    r = -errno;
+  }
+
+  if (r < 0) {
+    unlink(tmppath);
+    free(tmppath);
+    return r;
+  }
+
+  *tmppath_out = tmppath;
+  return 0;
+}
+
+/* Write data to a temporary file in dir and rename it over path. */
+static int write_atomic(const char *dir, const char *path, const char *data, size_t size) {
+  char *tmppath;
+  int r;
+
+  r = write_tmp(dir, data, size, &tmppath);
+  if (r < 0) {
+    return r;
+  }
+
+  if (rename(tmppath, path) < 0) {
+    r = -errno;
+    unlink(tmppath);
+  }
+
+  free(tmppath);
+
+  return r;
+}
+
+static int read_file(const char *path, char **data, size_t *size) {
+  struct stat st;
+  size_t nread = 0;
+  char *buf;
+  int fd, r = 0;
+
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  if (fstat(fd, &st) < 0) {
+    r = -errno;
+    close(fd);
+    return r;
+  }
+
+  buf = malloc(st.st_size + 1);
+  if (buf == NULL) {
+    close(fd);
+    return -ENOMEM;
+  }
+
+  while (nread < (size_t)st.st_size) {
+    ssize_t n = read(fd, buf + nread, st.st_size - nread);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      r = -errno;
+      break;
+    } else if (n == 0) {
+      break;
+    }
+    nread += n;
+  }
+
+  close(fd);
+
+  if (r < 0) {
+    free(buf);
+    return r;
+  }
+
+  buf[nread] = '\0';
+  *data = buf;
+  *size = nread;
+
+  return 0;
+}
+
+int store_open(const char *dir, off_t maxsize, store_t **store) {
+  static const char *subdirs[] = { "objects", "refs", "names", "partial" };
+  store_t *s;
+  size_t i;
+  int r;
+
+  s = calloc(1, sizeof(*s));
+  if (s == NULL) {
+    return -ENOMEM;
+  }
+
+  s->maxsize = maxsize;
+  s->dir = strdup(dir);
+  if (s->dir == NULL) {
+    free(s);
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < sizeof(subdirs) / sizeof(subdirs[0]); ++i) {
+    char *path;
+
+    if (asprintf(&path, "%s/%s/", dir, subdirs[i]) < 0) {
+      store_close(s);
+      return -ENOMEM;
+    }
+
+    r = mkdir_parents(path);
+    free(path);
+    if (r < 0) {
+      store_close(s);
+      return r;
+    }
+  }
+
+  *store = s;
+  return 0;
+}
+
+void store_close(store_t *store) {
+  if (store == NULL) {
+    return;
+  }
+
+  free(store->dir);
+  free(store);
+}
+
+static int object_cmp_age(const void *a, const void *b) {
+  const struct store_object_t *oa = a, *ob = b;
+
+  return (oa->mtime > ob->mtime) - (oa->mtime < ob->mtime);
+}
+
+/* Drop the least recently used objects until the store fits its limit. Refs
+ * to evicted objects are left dangling and cleaned up on their next lookup. */
+static void store_evict(store_t *store) {
+  struct store_object_t *objects = NULL;
+  size_t count = 0, capacity = 0, i;
+  off_t total = 0;
+  struct dirent *ent;
+  char *objdir;
+  DIR *dir;
+  int dfd;
+
+  if (asprintf(&objdir, "%s/objects", store->dir) < 0) {
+    return;
+  }
+
+  dir = opendir(objdir);
+  free(objdir);
+  if (dir == NULL) {
+    return;
+  }
+
+  dfd = dirfd(dir);
+
+  while ((ent = readdir(dir)) != NULL) {
+    struct stat st;
+
+    if (fstatat(dfd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    if (strncmp(ent->d_name, ".tmp-", 5) == 0) {
+      if (st.st_mtime + STORE_STALE_TMP < time(NULL)) {
+        unlinkat(dfd, ent->d_name, 0);
+      }
+      continue;
+    }
+
+    if (!valid_hash(ent->d_name)) {
+      continue;
+    }
+
+    if (count == capacity) {
+      struct store_object_t *newobjects;
+
+      capacity = capacity ? capacity * 2 : 64;
+      newobjects = realloc(objects, capacity * sizeof(*objects));
+      if (newobjects == NULL) {
+        goto finish;
+      }
+      objects = newobjects;
+    }
+
+    memcpy(objects[count].name, ent->d_name, sizeof(objects[count].name));
+    objects[count].mtime = st.st_mtime;
+    objects[count].size = st.st_size;
+    total += st.st_size;
+    count++;
+  }
+
+  if (total <= store->maxsize) {
+    goto finish;
+  }
+
+  qsort(objects, count, sizeof(*objects), object_cmp_age);
+
+  for (i = 0; i < count && total > store->maxsize; ++i) {
+    /* someone else may have beaten us to it, which is just as good */
+    if (unlinkat(dfd, objects[i].name, 0) == 0 || errno == ENOENT) {
+      total -= objects[i].size;
+    }
+  }
+
+finish:
+  closedir(dir);
+  free(objects);
+}
+
+/* Partial downloads which were never resumed are of no use to anyone. */
+static void store_prune_partials(store_t *store) {
+  struct dirent *ent;
+  char *partialdir;
+  DIR *dir;
+
+  if (asprintf(&partialdir, "%s/partial", store->dir) < 0) {
+    return;
+  }
+
+  dir = opendir(partialdir);
+  free(partialdir);
+  if (dir == NULL) {
+    return;
+  }
+
+  while ((ent = readdir(dir)) != NULL) {
+    struct stat st;
+
+    if (*ent->d_name == '.' && strncmp(ent->d_name, ".tmp-", 5) != 0) {
+      continue;
+    }
+
+    if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+        S_ISREG(st.st_mode) && st.st_mtime + STORE_STALE_TMP < time(NULL)) {
+      unlinkat(dirfd(dir), ent->d_name, 0);
+    }
+  }
+
+  closedir(dir);
+}
+
+/* Remove refs to older snapshots of pkgbase. The AUR only ever serves the
+ * newest one, so nothing will ask for them again. */
+static void store_prune_refs(const char *refdir, time_t keep) {
+  struct dirent *ent;
+  DIR *dir;
+
+  dir = opendir(refdir);
+  if (dir == NULL) {
+    return;
+  }
+
+  while ((ent = readdir(dir)) != NULL) {
+    char *end;
+    long long lastmodified = strtoll(ent->d_name, &end, 10);
+
+    if (*ent->d_name == '.' || *end != '\0' || lastmodified >= (long long)keep) {
+      continue;
+    }
+
+    unlinkat(dirfd(dir), ent->d_name, 0);
+  }
+
+  closedir(dir);
+}
+
+int store_get(store_t *store, const char *pkgbase, time_t lastmodified,
+    char **data, size_t *size) {
+  char *refpath = NULL, *objpath = NULL, *hash = NULL;
+  char sum[SHA256_HEXLEN + 1];
+  size_t hashlen;
+  int r;
+
+  if (!valid_name(pkgbase)) {
+    return -EINVAL;
+  }
+
+  if (asprintf(&refpath, "%s/refs/%s/%lld", store->dir, pkgbase, (long long)lastmodified) < 0) {
+    return -ENOMEM;
+  }
+
+  r = read_file(refpath, &hash, &hashlen);
+  if (r < 0) {
+    goto finish;
+  }
+
+  hash[strcspn(hash, "\n")] = '\0';
+  if (!valid_hash(hash)) {
+    r = -EBADMSG;
+    unlink(refpath);
+    goto finish;
+  }
+
+  if (asprintf(&objpath, "%s/objects/%s", store->dir, hash) < 0) {
+    objpath = NULL;
+    r = -ENOMEM;
+    goto finish;
+  }
+
+  r = read_file(objpath, data, size);
+  if (r < 0) {
+    /* evicted since the ref was written */
+    if (r == -ENOENT) {
+      unlink(refpath);
+    }
+    goto finish;
+  }
+
+  /* objects are named by their contents, so a mismatch means corruption */
+  sha256_hex(*data, *size, sum);
+  if (strcmp(sum, hash) != 0) {
+    free(*data);
+    *data = NULL;
+    unlink(objpath);
+    unlink(refpath);
+    r = -EBADMSG;
+    goto finish;
+  }
+
+  /* mark it recently used */
+  utimensat(AT_FDCWD, objpath, NULL, 0);
+
+finish:
+  free(refpath);
+  free(objpath);
+  free(hash);
+
+  return r;
+}
+
+int store_put(store_t *store, const char *pkgbase, time_t lastmodified,
+    const char *data, size_t size) {
+  char *objdir = NULL, *tmppath = NULL, *objpath = NULL;
+  char *refdir = NULL, *refpath = NULL;
+  char sum[SHA256_HEXLEN + 1];
+  int r;
+
+  if (!valid_name(pkgbase)) {
+    return -EINVAL;
+  }
+
+  if (asprintf(&objdir, "%s/objects", store->dir) < 0 ||
+      asprintf(&refdir, "%s/refs/%s", store->dir, pkgbase) < 0 ||
+      asprintf(&refpath, "%s/%lld", refdir, (long long)lastmodified) < 0) {
+    r = -ENOMEM;
+    goto finish;
+  }
+
+  /* write the tarball aside, then move it to the name its contents hash to */
+  sha256_hex(data, size, sum);
+  if (asprintf(&objpath, "%s/%s", objdir, sum) < 0) {
+    objpath = NULL;
+    r = -ENOMEM;
+    goto finish;
+  }
+
+  r = write_tmp(objdir, data, size, &tmppath);
+  if (r < 0) {
+    goto finish;
+  }
+
+  if (rename(tmppath, objpath) < 0) {
+    r = -errno;
+    unlink(tmppath);
+    goto finish;
+  }
+
+  r = mkdir_parents(refpath);
+  if (r < 0) {
+    goto finish;
+  }
+
+  r = write_atomic(refdir, refpath, sum, strlen(sum));
+  if (r < 0) {
+    goto finish;
+  }
+
+  store_prune_refs(refdir, lastmodified);
+  store_evict(store);
+  store_prune_partials(store);
+
+finish:
+  free(objdir);
+  free(tmppath);
+  free(objpath);
+  free(refdir);
+  free(refpath);
+
+  return r;
+}
+
+static char *partial_path(store_t *store, const char *pkgbase, time_t lastmodified) {
+  char *path;
+
+  if (asprintf(&path, "%s/partial/%s-%lld", store->dir, pkgbase, (long long)lastmodified) < 0) {
+    return NULL;
+  }
+
+  return path;
+}
+
+int store_partial_get(store_t *store, const char *pkgbase, time_t lastmodified,
+    char **etag, char **data, size_t *size) {
+  char *path, *buf, *eol;
+  size_t bufsize;
+  int r;
+
+  if (!valid_name(pkgbase)) {
+    return -EINVAL;
+  }
+
+  path = partial_path(store, pkgbase, lastmodified);
+  if (path == NULL) {
+    return -ENOMEM;
+  }
+
+  r = read_file(path, &buf, &bufsize);
+  if (r < 0) {
+    free(path);
+    return r;
+  }
+
+  /* the etag, then the bytes received so far */
+  eol = memchr(buf, '\n', bufsize);
+  if (eol == NULL || eol == buf) {
+    unlink(path);
+    free(path);
+    free(buf);
+    return -EBADMSG;
+  }
+
+  free(path);
+
+  *etag = strndup(buf, eol - buf);
+  if (*etag == NULL) {
+    free(buf);
+    return -ENOMEM;
+  }
+
+  *size = bufsize - (eol - buf) - 1;
+  memmove(buf, eol + 1, *size);
+  *data = buf;
+
+  return 0;
+}
+
+int store_partial_put(store_t *store, const char *pkgbase, time_t lastmodified,
+    const char *etag, const char *data, size_t size) {
+  char *partialdir = NULL, *path = NULL, *buf = NULL;
+  size_t etaglen = strlen(etag);
+  int r;
+
+  if (!valid_name(pkgbase) || etaglen == 0 || strchr(etag, '\n') != NULL) {
+    return -EINVAL;
+  }
+
+  path = partial_path(store, pkgbase, lastmodified);
+  buf = malloc(etaglen + 1 + size);
+  if (path == NULL || buf == NULL ||
+      asprintf(&partialdir, "%s/partial", store->dir) < 0) {
+    partialdir = NULL;
+    r = -ENOMEM;
+    goto finish;
+  }
+
+  memcpy(buf, etag, etaglen);
+  buf[etaglen] = '\n';
+  memcpy(buf + etaglen + 1, data, size);
+
+  r = write_atomic(partialdir, path, buf, etaglen + 1 + size);
+
+finish:
+  free(partialdir);
+  free(path);
+  free(buf);
+
+  return r;
+}
+
+void store_partial_drop(store_t *store, const char *pkgbase, time_t lastmodified) {
+  char *path;
+
+  if (!valid_name(pkgbase)) {
+    return;
+  }
+
+  path = partial_path(store, pkgbase, lastmodified);
+  if (path != NULL) {
+    unlink(path);
+    free(path);
+  }
+}
+
+int store_name_get(store_t *store, const char *name, struct store_ref_t *ref) {
+  char *path, *data, *line, *saveptr = NULL;
+  size_t size;
+  int r;
+
+  memset(ref, 0, sizeof(*ref));
+
+  if (!valid_name(name)) {
+    return -EINVAL;
+  }
+
+  if (asprintf(&path, "%s/names/%s", store->dir, name) < 0) {
+    return -ENOMEM;
+  }
+
+  r = read_file(path, &data, &size);
+  free(path);
+  if (r < 0) {
+    return r;
+  }
+
+  /* pkgbase, lastmodified and version, one per line */
+  line = strtok_r(data, "\n", &saveptr);
+  if (line != NULL) {
+    ref->pkgbase = strdup(line);
+    line = strtok_r(NULL, "\n", &saveptr);
+  }
+  if (line != NULL) {
+    ref->lastmodified = (time_t)strtoll(line, NULL, 10);
+    line = strtok_r(NULL, "\n", &saveptr);
+  }
+  if (line != NULL) {
+    ref->version = strdup(line);
+  }
+
+  free(data);
+
+  if (ref->pkgbase == NULL || ref->version == NULL || !valid_name(ref->pkgbase)) {
+    store_ref_clear(ref);
+    return -EBADMSG;
+  }
+
+  return 0;
+}
+
+int store_name_set(store_t *store, const char *name, const struct store_ref_t *ref) {
+  char *namedir = NULL, *path = NULL, *data = NULL;
+  int len, r;
+
+  if (!valid_name(name)) {
+    return -EINVAL;
+  }
+
+  if (asprintf(&namedir, "%s/names", store->dir) < 0 ||
+      asprintf(&path, "%s/%s", namedir, name) < 0 ||
+      (len = asprintf(&data, "%s\n%lld\n%s\n", ref->pkgbase,
+                      (long long)ref->lastmodified, ref->version)) < 0) {
+    r = -ENOMEM;
+    goto finish;
+  }
+
+  r = write_atomic(namedir, path, data, len);
+
+finish:
+  free(namedir);
+  free(path);
+  free(data);
+
+  return r;
+}
+
+void store_ref_clear(struct store_ref_t *ref) {
+  free(ref->pkgbase);
+  free(ref->version);
+  memset(ref, 0, sizeof(*ref));
+}
@@ -0,0 +1,46 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/* A content addressed store of snapshot tarballs, which may be shared by any
+ * number of cower processes. Tarballs live under objects/, named by their
+ * sha256 sum, and are found through refs/<pkgbase>/<lastmodified>. Every file
+ * is written aside and renamed into place, so nobody ever sees a partial one.
+ * Once the store grows past its size limit, the least recently used tarballs
+ * are evicted. */
+typedef struct store_t store_t;
+
+/* What names/ remembers about a package, so that downloads can be served from
+ * the store without asking the AUR anything. */
+struct store_ref_t {
+  char *pkgbase;
+  char *version;
+  time_t lastmodified;
+};
+
+int store_open(const char *dir, off_t maxsize, store_t **store);
+void store_close(store_t *store);
+
+/* On success, *data holds the tarball and must be freed by the caller.
+ * Returns -ENOENT if the store doesn't have this snapshot. */
+int store_get(store_t *store, const char *pkgbase, time_t lastmodified,
+    char **data, size_t *size);
+int store_put(store_t *store, const char *pkgbase, time_t lastmodified,
+    const char *data, size_t size);
+
+/* Partially downloaded tarballs, kept so that an interrupted transfer can be
+ * resumed later. etag identifies the tarball the bytes belong to, and is what
+ * the resumed request must be validated against. */
+int store_partial_get(store_t *store, const char *pkgbase, time_t lastmodified,
+    char **etag, char **data, size_t *size);
+int store_partial_put(store_t *store, const char *pkgbase, time_t lastmodified,
+    const char *etag, const char *data, size_t size);
+void store_partial_drop(store_t *store, const char *pkgbase, time_t lastmodified);
+
+int store_name_get(store_t *store, const char *name, struct store_ref_t *ref);
+int store_name_set(store_t *store, const char *name, const struct store_ref_t *ref);
+void store_ref_clear(struct store_ref_t *ref);
+
+#endif  /* STORE_H */
@@ -0,0 +1,176 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "macro.h"
+#include "strset.h"
+
+/* Each shard is an open addressed table behind its own lock, so unrelated
+ * inserts from different threads rarely contend. */
+#define STRSET_SHARDS 16
+
+struct strset_entry_t {
+  uint64_t hash;
+  char *key;
+};
+
+struct strset_shard_t {
+  pthread_mutex_t lock;
+  struct strset_entry_t *entries;
+  size_t count;
+  size_t capacity;
+};
+
+struct strset_t {
+  struct strset_shard_t shards[STRSET_SHARDS];
+};
+
+static struct strset_entry_t *shard_find_slot(struct strset_entry_t *entries, size_t capacity,
+    uint64_t hash, const char *str, size_t len) {
+  size_t i = (hash / STRSET_SHARDS) & (capacity - 1);
+
+  for (;;) {
+    struct strset_entry_t *e = &entries[i];
+
+    if (e->key == NULL) {
+      return e;
+    }
+
+    if (e->hash == hash && strncmp(e->key, str, len) == 0 && e->key[len] == '\0') {
+      return e;
+    }
+
+    i = (i + 1) & (capacity - 1);
+  }
+}
+
+static int shard_grow(struct strset_shard_t *shard) {
+  struct strset_entry_t *entries;
+  size_t newcap = shard->capacity ? shard->capacity * 2 : 64;
+  size_t i;
+
+  entries = calloc(newcap, sizeof(*entries));
+  if (entries == NULL) {
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < shard->capacity; ++i) {
+    struct strset_entry_t *e = &shard->entries[i];
+
+    if (e->key != NULL) {
+      *shard_find_slot(entries, newcap, e->hash, e->key, strlen(e->key)) = *e;
+    }
+  }
+
+  free(shard->entries);
+  shard->entries = entries;
+  shard->capacity = newcap;
+
+  return 0;
+}
+
+int strset_new(strset_t **set) {
+  strset_t *s;
+  size_t i;
+
+  s = calloc(1, sizeof(*s));
+  if (s == NULL) {
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < ARRAYSIZE(s->shards); ++i) {
+    pthread_mutex_init(&s->shards[i].lock, NULL);
+  }
+
+  *set = s;
+  return 0;
+}
+
+void strset_free(strset_t *set) {
+  size_t i, j;
+
+  if (set == NULL) {
+    return;
+  }
+
+  for (i = 0; i < ARRAYSIZE(set->shards); ++i) {
+    struct strset_shard_t *shard = &set->shards[i];
+
+    for (j = 0; j < shard->capacity; ++j) {
+      free(shard->entries[j].key);
+    }
+
+    free(shard->entries);
+    pthread_mutex_destroy(&shard->lock);
+  }
+
+  free(set);
+}
+
+int strset_add(strset_t *set, const char *str, size_t len, const char **key) {
+  const uint64_t hash = hash_string(str, len);
+  struct strset_shard_t *shard = &set->shards[hash % STRSET_SHARDS];
+  struct strset_entry_t *e;
+  int r = 0;
+
+  pthread_mutex_lock(&shard->lock);
+
+  /* keep the load factor under 3/4 */
+  if ((shard->count + 1) * 4 > shard->capacity * 3) {
+    r = shard_grow(shard);
+    if (r < 0) {
+      goto finish;
+    }
+  }
+
+  e = shard_find_slot(shard->entries, shard->capacity, hash, str, len);
+  if (e->key == NULL) {
+    e->key = strndup(str, len);
+    if (e->key == NULL) {
+      r = -ENOMEM;
+      goto finish;
+    }
+
+    e->hash = hash;
+    shard->count++;
+    r = 1;
+  }
+
+  if (key != NULL) {
+    *key = e->key;
+  }
+
+finish:
+  pthread_mutex_unlock(&shard->lock);
+
+  return r;
+}
+
+int strset_contains(strset_t *set, const char *str, size_t len) {
+  const uint64_t hash = hash_string(str, len);
+  struct strset_shard_t *shard = &set->shards[hash % STRSET_SHARDS];
+  int r = 0;
+
+  pthread_mutex_lock(&shard->lock);
+  if (shard->capacity > 0) {
+    r = shard_find_slot(shard->entries, shard->capacity, hash, str, len)->key != NULL;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  return r;
+}
+
+size_t strset_count(strset_t *set) {
+  size_t i, count = 0;
+
+  for (i = 0; i < ARRAYSIZE(set->shards); ++i) {
+    pthread_mutex_lock(&set->shards[i].lock);
+    count += set->shards[i].count;
+    pthread_mutex_unlock(&set->shards[i].lock);
+  }
+
+  return count;
+}
@@ -0,0 +1,19 @@
+#ifndef STRSET_H
+#define STRSET_H
+
+#include <stddef.h>
+
+/* A set of strings which is safe to share between threads. Keys are copied
+ * into the set and remain valid until the set is freed. */
+typedef struct strset_t strset_t;
+
+int strset_new(strset_t **set);
+void strset_free(strset_t *set);
+
+/* Returns 1 if str was inserted, 0 if it was already present, or a negative
+ * errno on failure. If key is non-NULL, it receives the set's copy of str. */
+int strset_add(strset_t *set, const char *str, size_t len, const char **key);
+int strset_contains(strset_t *set, const char *str, size_t len);
+size_t strset_count(strset_t *set);
+
+#endif  /* STRSET_H */
@@ -0,0 +1,139 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "throttle.h"
+
+/* how much may arrive at once after a lull, in seconds of the rate */
+#define THROTTLE_BURST 0.25
+
+/* at the least, enough for curl to hand over a full buffer */
+#define THROTTLE_MIN_BURST (16 * 1024)
+
+struct throttle_waiter_t {
+  double tag;
+  struct throttle_waiter_t *next;
+};
+
+struct throttle_t {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  /* bytes per second */
+  double rate;
+  double burst;
+
+  double tokens;
+  uint64_t refilled;
+
+  /* the start tag of whoever was served last, and those waiting to be, in
+   * order of their tags. only the first of them may pay. */
+  double vtime;
+  struct throttle_waiter_t *waiters;
+  int paying;
+};
+
+static uint64_t now_usec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int throttle_new(long rate, throttle_t **throttle) {
+  throttle_t *t;
+
+  if (rate <= 0) {
+    return -EINVAL;
+  }
+
+  t = calloc(1, sizeof(*t));
+  if (t == NULL) {
+    return -ENOMEM;
+  }
+
+  pthread_mutex_init(&t->lock, NULL);
+  pthread_cond_init(&t->cond, NULL);
+  t->rate = rate;
+  t->burst = rate * THROTTLE_BURST;
+  if (t->burst < THROTTLE_MIN_BURST) {
+    t->burst = THROTTLE_MIN_BURST;
+  }
+  t->tokens = t->burst;
+  t->refilled = now_usec();
+
+  *throttle = t;
+  return 0;
+}
+
+void throttle_free(throttle_t *throttle) {
+  if (throttle == NULL) {
+    return;
+  }
+
+  pthread_cond_destroy(&throttle->cond);
+  pthread_mutex_destroy(&throttle->lock);
+  free(throttle);
+}
+
+static void throttle_refill(throttle_t *throttle) {
+  const uint64_t now = now_usec();
+
+  throttle->tokens += (now - throttle->refilled) * throttle->rate / 1000000;
+  if (throttle->tokens > throttle->burst) {
+    throttle->tokens = throttle->burst;
+  }
+  throttle->refilled = now;
+}
+
+void throttle_consume(throttle_t *throttle, double *flow, size_t bytes, int urgent) {
+  struct throttle_waiter_t self, **w;
+
+  pthread_mutex_lock(&throttle->lock);
+
+  throttle_refill(throttle);
+
+  if (urgent) {
+    throttle->tokens -= bytes;
+    pthread_mutex_unlock(&throttle->lock);
+    return;
+  }
+
+  /* a flow which has been idle starts from now, rather than from wherever
+   * it left off, so it can't save up a claim on the link */
+  self.tag = *flow > throttle->vtime ? *flow : throttle->vtime;
+  *flow = self.tag + bytes;
+
+  for (w = &throttle->waiters; *w && (*w)->tag <= self.tag; w = &(*w)->next);
+  self.next = *w;
+  *w = &self;
+
+  while (throttle->waiters != &self || throttle->paying) {
+    pthread_cond_wait(&throttle->cond, &throttle->lock);
+  }
+
+  throttle->waiters = self.next;
+  throttle->paying = 1;
+  throttle->vtime = self.tag;
+
+  while (throttle_refill(throttle), throttle->tokens < (double)bytes) {
+    const double usec = (bytes - throttle->tokens) / throttle->rate * 1000000;
+    struct timespec delay = {
+      .tv_sec = (time_t)(usec / 1000000),
+      .tv_nsec = (long)(usec - (time_t)(usec / 1000000) * 1000000.0) * 1000,
+    };
+
+    pthread_mutex_unlock(&throttle->lock);
+    while (nanosleep(&delay, &delay) < 0 && errno == EINTR);
+    pthread_mutex_lock(&throttle->lock);
+  }
+
+  throttle->tokens -= bytes;
+  throttle->paying = 0;
+  pthread_cond_broadcast(&throttle->cond);
+
+  pthread_mutex_unlock(&throttle->lock);
+}
@@ -0,0 +1,22 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stddef.h>
+
+/* One cap on the bandwidth of every transfer in the process, as a token
+ * bucket which all of them draw from. Transfers pay for what they've
+ * received before receiving more, and are served by start-time fair
+ * queueing, so that each active one gets an equal share of the rate however
+ * its data happens to be chunked. */
+typedef struct throttle_t throttle_t;
+
+int throttle_new(long rate, throttle_t **throttle);
+void throttle_free(throttle_t *throttle);
+
+/* Account for bytes a transfer just received, blocking until the cap allows
+ * them. flow is the transfer's place in the queue, which must start out as
+ * 0 and is carried from one call to the next. Urgent transfers are charged,
+ * but never made to wait; they are paid for by whoever waits next. */
+void throttle_consume(throttle_t *throttle, double *flow, size_t bytes, int urgent);
+
+#endif  /* THROTTLE_H */
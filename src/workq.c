@@ -0,0 +1,272 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "workq.h"
+
+struct workq_deque_t {
+  pthread_mutex_t lock;
+
+  /* ring buffer, with jobs in [head, head + count) */
+  void **jobs;
+  size_t head;
+  size_t count;
+  size_t capacity;
+};
+
+struct workq_t {
+  struct workq_deque_t *deques;
+  int nworkers;
+
+  /* round robin cursor for jobs pushed from outside of the pool */
+  unsigned next;
+
+  /* jobs sitting in a deque, and jobs pushed but not yet done */
+  long queued;
+  long pending;
+
+  /* the most jobs to let sit in the deques, and pushes from outside of the
+   * pool which have room reserved but haven't landed yet */
+  long capacity;
+  long inbound;
+
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+  pthread_cond_t space_cond;
+  int closed;
+};
+
+static int deque_push_back(struct workq_deque_t *d, void *job) {
+  if (d->count == d->capacity) {
+    size_t newcap = d->capacity ? d->capacity * 2 : 32;
+    void **jobs;
+    size_t i;
+
+    jobs = malloc(newcap * sizeof(*jobs));
+    if (jobs == NULL) {
+      return -ENOMEM;
+    }
+
+    for (i = 0; i < d->count; ++i) {
+      jobs[i] = d->jobs[(d->head + i) % d->capacity];
+    }
+
+    free(d->jobs);
+    d->jobs = jobs;
+    d->head = 0;
+    d->capacity = newcap;
+  }
+
+  d->jobs[(d->head + d->count) % d->capacity] = job;
+  d->count++;
+
+  return 0;
+}
+
+static void *deque_pop_back(struct workq_deque_t *d) {
+  if (d->count == 0) {
+    return NULL;
+  }
+
+  d->count--;
+  return d->jobs[(d->head + d->count) % d->capacity];
+}
+
+static void *deque_pop_front(struct workq_deque_t *d) {
+  void *job;
+
+  if (d->count == 0) {
+    return NULL;
+  }
+
+  job = d->jobs[d->head];
+  d->head = (d->head + 1) % d->capacity;
+  d->count--;
+
+  return job;
+}
+
+int workq_new(workq_t **q, int nworkers) {
+  workq_t *w;
+  int i;
+
+  if (nworkers <= 0) {
+    return -EINVAL;
+  }
+
+  w = calloc(1, sizeof(*w));
+  if (w == NULL) {
+    return -ENOMEM;
+  }
+
+  w->deques = calloc(nworkers, sizeof(*w->deques));
+  if (w->deques == NULL) {
+    free(w);
+    return -ENOMEM;
+  }
+
+  w->nworkers = nworkers;
+  for (i = 0; i < nworkers; ++i) {
+    pthread_mutex_init(&w->deques[i].lock, NULL);
+  }
+
+  pthread_mutex_init(&w->idle_lock, NULL);
+  pthread_cond_init(&w->idle_cond, NULL);
+  pthread_cond_init(&w->space_cond, NULL);
+
+  *q = w;
+  return 0;
+}
+
+void workq_free(workq_t *q) {
+  int i;
+
+  if (q == NULL) {
+    return;
+  }
+
+  for (i = 0; i < q->nworkers; ++i) {
+    free(q->deques[i].jobs);
+    pthread_mutex_destroy(&q->deques[i].lock);
+  }
+
+  pthread_cond_destroy(&q->space_cond);
+  pthread_cond_destroy(&q->idle_cond);
+  pthread_mutex_destroy(&q->idle_lock);
+  free(q->deques);
+  free(q);
+}
+
+void workq_limit(workq_t *q, long capacity) {
+  q->capacity = capacity;
+}
+
+int workq_push(workq_t *q, int worker, void *job) {
+  struct workq_deque_t *d;
+  int r, reserved = 0;
+
+  if (worker < 0 || worker >= q->nworkers) {
+    pthread_mutex_lock(&q->idle_lock);
+    if (q->capacity > 0) {
+      while (__atomic_load_n(&q->queued, __ATOMIC_SEQ_CST) + q->inbound >= q->capacity) {
+        pthread_cond_wait(&q->space_cond, &q->idle_lock);
+      }
+      q->inbound++;
+      reserved = 1;
+    }
+    pthread_mutex_unlock(&q->idle_lock);
+
+    worker = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED) % q->nworkers;
+  }
+
+  __atomic_add_fetch(&q->pending, 1, __ATOMIC_SEQ_CST);
+
+  d = &q->deques[worker];
+  pthread_mutex_lock(&d->lock);
+  r = deque_push_back(d, job);
+  pthread_mutex_unlock(&d->lock);
+
+  if (r == 0) {
+    __atomic_add_fetch(&q->queued, 1, __ATOMIC_SEQ_CST);
+  } else {
+    __atomic_sub_fetch(&q->pending, 1, __ATOMIC_SEQ_CST);
+  }
+
+  /* wake a sleeper, if any. taking the lock orders this against a worker
+   * which has just found every deque empty and is about to wait. */
+  pthread_mutex_lock(&q->idle_lock);
+  if (reserved) {
+    q->inbound--;
+    if (r < 0) {
+      pthread_cond_signal(&q->space_cond);
+    }
+  }
+  if (r == 0) {
+    pthread_cond_signal(&q->idle_cond);
+  }
+  pthread_mutex_unlock(&q->idle_lock);
+
+  return r;
+}
+
+static void *workq_take(workq_t *q, int worker) {
+  void *job = NULL;
+  int i;
+
+  if (worker >= 0 && worker < q->nworkers) {
+    struct workq_deque_t *d = &q->deques[worker];
+
+    pthread_mutex_lock(&d->lock);
+    job = deque_pop_back(d);
+    pthread_mutex_unlock(&d->lock);
+  } else {
+    worker = 0;
+  }
+
+  /* nothing of our own, so go steal the oldest job from someone else */
+  for (i = 1; job == NULL && i <= q->nworkers; ++i) {
+    struct workq_deque_t *d = &q->deques[(worker + i) % q->nworkers];
+
+    if (pthread_mutex_trylock(&d->lock) != 0) {
+      continue;
+    }
+    job = deque_pop_front(d);
+    pthread_mutex_unlock(&d->lock);
+  }
+
+  if (job != NULL) {
+    __atomic_sub_fetch(&q->queued, 1, __ATOMIC_SEQ_CST);
+
+    /* let a blocked push from outside of the pool into the freed slot */
+    if (q->capacity > 0) {
+      pthread_mutex_lock(&q->idle_lock);
+      pthread_cond_signal(&q->space_cond);
+      pthread_mutex_unlock(&q->idle_lock);
+    }
+  }
+
+  return job;
+}
+
+static int workq_finished(workq_t *q) {
+  return q->closed && __atomic_load_n(&q->pending, __ATOMIC_SEQ_CST) == 0;
+}
+
+void *workq_pop(workq_t *q, int worker) {
+  for (;;) {
+    void *job = workq_take(q, worker);
+    if (job != NULL) {
+      return job;
+    }
+
+    pthread_mutex_lock(&q->idle_lock);
+    while (__atomic_load_n(&q->queued, __ATOMIC_SEQ_CST) == 0 && !workq_finished(q)) {
+      pthread_cond_wait(&q->idle_cond, &q->idle_lock);
+    }
+
+    if (__atomic_load_n(&q->queued, __ATOMIC_SEQ_CST) == 0 && workq_finished(q)) {
+      pthread_mutex_unlock(&q->idle_lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&q->idle_lock);
+  }
+}
+
+void workq_hold(workq_t *q) {
+  __atomic_add_fetch(&q->pending, 1, __ATOMIC_SEQ_CST);
+}
+
+void workq_done(workq_t *q) {
+  if (__atomic_sub_fetch(&q->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+    pthread_mutex_lock(&q->idle_lock);
+    pthread_cond_broadcast(&q->idle_cond);
+    pthread_mutex_unlock(&q->idle_lock);
+  }
+}
+
+void workq_close(workq_t *q) {
+  pthread_mutex_lock(&q->idle_lock);
+  q->closed = 1;
+  pthread_cond_broadcast(&q->idle_cond);
+  pthread_mutex_unlock(&q->idle_lock);
+}
@@ -0,0 +1,34 @@
+#ifndef WORKQ_H
+#define WORKQ_H
+
+/* A work stealing scheduler. Each worker owns a deque: it pushes and pops
+ * its own jobs at the back, while idle workers steal from the front of
+ * another worker's deque. Jobs pushed from outside of the pool are spread
+ * across the deques.
+ *
+ * workq_pop blocks until a job is available, and returns NULL once the queue
+ * has been closed and every job handed out has been marked done with
+ * workq_done. Since running jobs may push more jobs, workers must not leave
+ * until then. */
+typedef struct workq_t workq_t;
+
+int workq_new(workq_t **q, int nworkers);
+void workq_free(workq_t *q);
+
+/* Once capacity jobs are sitting in the queue, pushes from outside of the
+ * pool block until a worker takes one. Workers themselves are never held up,
+ * since they'd be waiting on each other. 0, the default, means no limit.
+ * Must be set before anything is pushed. */
+void workq_limit(workq_t *q, long capacity);
+
+/* worker is the index of the calling worker, or -1 if the caller isn't one */
+int workq_push(workq_t *q, int worker, void *job);
+void *workq_pop(workq_t *q, int worker);
+void workq_done(workq_t *q);
+
+/* Count work carried on somewhere else as pending, so that the queue isn't
+ * drained while it might still push more jobs. Balance with workq_done. */
+void workq_hold(workq_t *q);
+void workq_close(workq_t *q);
+
+#endif  /* WORKQ_H */